@@ -0,0 +1,218 @@
+#pragma once
+
+// Counts heap allocations, so that tests can pin the allocation behaviour of serialize/parse
+// calls. Define PROTOPUG_ALLOCATION_COUNTER_IMPLEMENTATION in exactly one translation unit of the
+// test program before including this header: that replaces the global operator new/delete with
+// counting versions. With glibc malloc, calloc, realloc and the aligned variants are replaced as
+// well, so that C allocations are counted too; elsewhere only operator new is seen.
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+namespace protopug
+{
+    namespace detail
+    {
+        inline thread_local size_t allocation_count = 0;
+        inline bool allocation_counter_installed = false;
+    }
+
+    // False when no translation unit provides the counting operator new, every count is 0 then
+    inline bool allocation_counter_installed()
+    {
+        return detail::allocation_counter_installed;
+    }
+
+    // Allocations made by the calling thread while fn runs
+    template<class Fn>
+    size_t count_allocations(Fn &&fn)
+    {
+        size_t before = detail::allocation_count;
+        fn();
+        return detail::allocation_count - before;
+    }
+}
+
+#if defined(PROTOPUG_ALLOCATION_COUNTER_IMPLEMENTATION)
+namespace protopug
+{
+    namespace detail
+    {
+#if defined(__GLIBC__)
+        // malloc counts, operator new must not count the same allocation again
+        constexpr bool counts_malloc = true;
+#else
+        constexpr bool counts_malloc = false;
+#endif
+
+        void *counted_allocate(std::size_t size, std::size_t alignment)
+        {
+            if constexpr(!counts_malloc) ++allocation_count;
+
+            if (size == 0) size = 1;
+            while (true)
+            {
+                void *data = alignment > alignof(std::max_align_t)
+                             ? std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment)
+                             : std::malloc(size);
+                if (data) return data;
+
+                auto handler = std::get_new_handler();
+                if (!handler) throw std::bad_alloc();
+                handler();
+            }
+        }
+
+        const bool allocation_counter_registration = (allocation_counter_installed = true);
+    }
+}
+
+#if defined(__GLIBC__)
+#include <cerrno>
+
+// glibc exports its allocator under __libc_ names, the replacements forward there
+extern "C"
+{
+    void *__libc_malloc(std::size_t size);
+    void *__libc_calloc(std::size_t count, std::size_t size);
+    void *__libc_realloc(void *data, std::size_t size);
+    void *__libc_memalign(std::size_t alignment, std::size_t size);
+    void __libc_free(void *data);
+
+    void *malloc(std::size_t size) noexcept
+    {
+        ++protopug::detail::allocation_count;
+        return __libc_malloc(size);
+    }
+
+    void *calloc(std::size_t count, std::size_t size) noexcept
+    {
+        ++protopug::detail::allocation_count;
+        return __libc_calloc(count, size);
+    }
+
+    void *realloc(void *data, std::size_t size) noexcept
+    {
+        ++protopug::detail::allocation_count;
+        return __libc_realloc(data, size);
+    }
+
+    void *memalign(std::size_t alignment, std::size_t size) noexcept
+    {
+        ++protopug::detail::allocation_count;
+        return __libc_memalign(alignment, size);
+    }
+
+    void *aligned_alloc(std::size_t alignment, std::size_t size) noexcept
+    {
+        ++protopug::detail::allocation_count;
+        return __libc_memalign(alignment, size);
+    }
+
+    int posix_memalign(void **data, std::size_t alignment, std::size_t size) noexcept
+    {
+        if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0) return EINVAL;
+
+        ++protopug::detail::allocation_count;
+        void *result = __libc_memalign(alignment, size);
+        if (!result) return ENOMEM;
+
+        *data = result;
+        return 0;
+    }
+
+    void free(void *data) noexcept
+    {
+        __libc_free(data);
+    }
+}
+#endif
+
+void *operator new(std::size_t size)
+{
+    return protopug::detail::counted_allocate(size, alignof(std::max_align_t));
+}
+
+void *operator new[](std::size_t size)
+{
+    return protopug::detail::counted_allocate(size, alignof(std::max_align_t));
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment)
+{
+    return protopug::detail::counted_allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment)
+{
+    return protopug::detail::counted_allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+    try
+    {
+        return protopug::detail::counted_allocate(size, alignof(std::max_align_t));
+    }
+    catch (const std::bad_alloc &)
+    {
+        return nullptr;
+    }
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+    return ::operator new(size, std::nothrow);
+}
+
+// GCC flags free() on memory from operator new once these are inlined, it is what new uses here
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void operator delete(void *data) noexcept
+{
+    std::free(data);
+}
+
+void operator delete[](void *data) noexcept
+{
+    std::free(data);
+}
+
+void operator delete(void *data, std::size_t) noexcept
+{
+    std::free(data);
+}
+
+void operator delete[](void *data, std::size_t) noexcept
+{
+    std::free(data);
+}
+
+void operator delete(void *data, std::align_val_t) noexcept
+{
+    std::free(data);
+}
+
+void operator delete[](void *data, std::align_val_t) noexcept
+{
+    std::free(data);
+}
+
+void operator delete(void *data, std::size_t, std::align_val_t) noexcept
+{
+    std::free(data);
+}
+
+void operator delete[](void *data, std::size_t, std::align_val_t) noexcept
+{
+    std::free(data);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
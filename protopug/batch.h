@@ -0,0 +1,142 @@
+#pragma once
+
+#include "protopug.h"
+
+#include <string_view>
+
+namespace protopug
+{
+    // Batch layout: message count, end offset of every message relative to the first one, then the
+    // messages back to back. Count and offsets are fixed32, so a batch is limited to 4 GiB of messages.
+    struct batch_view
+    {
+        explicit batch_view(std::string_view in)
+        {
+            uint32_t count;
+            if (in.size() < sizeof(count)) return;
+
+            std::memcpy(&count, in.data(), sizeof(count));
+            size_t header_size = sizeof(uint32_t) * (static_cast<size_t>(count) + 1);
+            if (in.size() < header_size) return;
+
+            uint32_t previous_offset = 0;
+            for (size_t i = 0; i < count; ++i)
+            {
+                uint32_t offset = this->offset(in.data(), i);
+                if (offset < previous_offset) return;
+                previous_offset = offset;
+            }
+
+            if (previous_offset > in.size() - header_size) return;
+
+            _header = in.data();
+            _payload = in.data() + header_size;
+            _count = count;
+            _valid = true;
+        }
+
+        bool valid() const
+        {
+            return _valid;
+        }
+
+        size_t size() const
+        {
+            return _count;
+        }
+
+        std::string_view operator[](size_t index) const
+        {
+            uint32_t begin = index == 0 ? 0 : offset(_header, index - 1);
+            return std::string_view(_payload + begin, offset(_header, index) - begin);
+        }
+
+    private:
+        static uint32_t offset(const char *header, size_t index)
+        {
+            uint32_t offset;
+            std::memcpy(&offset, header + sizeof(uint32_t) * (index + 1), sizeof(offset));
+            return offset;
+        }
+
+        const char *_header = nullptr;
+        const char *_payload = nullptr;
+        size_t _count = 0;
+        bool _valid = false;
+    };
+
+    // Appends a batch of count messages to out
+    template<class T>
+    bool serialize_many(const T *values, size_t count, std::string &out)
+    {
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+        static_assert(false, "Not a little-endian");
+#endif
+        if (count > UINT32_MAX) return false;
+
+        const auto &message = message_type<T>();
+
+        const size_t base = out.size();
+        const size_t payload = base + sizeof(uint32_t) * (count + 1);
+        out.resize(payload);
+
+        auto count32 = static_cast<uint32_t>(count);
+        std::memcpy(&out[base], &count32, sizeof(count32));
+
+        // Offsets come from a size pass, so that the buffer grows once to its exact size and a batch
+        // past 4 GiB is refused before anything is encoded
+        size_t end = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            detail::writer_size_collector size_collector;
+            detail::write_message(values[i], message, size_collector);
+
+            end += size_collector.byte_size;
+            if (end > UINT32_MAX)
+            {
+                out.resize(base);
+                return false;
+            }
+
+            auto end32 = static_cast<uint32_t>(end);
+            std::memcpy(&out[base + sizeof(uint32_t) * (i + 1)], &end32, sizeof(end32));
+        }
+
+        out.reserve(payload + end);
+
+        string_writer string_out(out);
+        for (size_t i = 0; i < count; ++i)
+        {
+            detail::write_message(values[i], message, string_out);
+        }
+
+        return true;
+    }
+
+    template<class T>
+    bool serialize_many(const std::vector<T> &values, std::string &out)
+    {
+        return serialize_many(values.data(), values.size(), out);
+    }
+
+    // Appends the messages of a batch to values
+    template<class T>
+    bool parse_many(std::vector<T> &values, std::string_view in)
+    {
+        batch_view batch(in);
+        if (!batch.valid()) return false;
+
+        const auto &message = message_type<T>();
+
+        values.reserve(values.size() + batch.size());
+        for (size_t i = 0; i < batch.size(); ++i)
+        {
+            auto bytes = batch[i];
+            buffer_reader buffer_in(bytes.data(), bytes.size());
+            if (!detail::read_message(values.emplace_back(), message, buffer_in))
+                return false;
+        }
+
+        return true;
+    }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+// Member type for huge bytes fields that are never held in memory as a whole. Parsing hands the
+// payload to a sink in fixed size chunks as it is read, serialization pulls it from a source.
+
+#include "protopug.h"
+
+#include <functional>
+
+namespace protopug
+{
+    struct byte_stream
+    {
+        // Parsing: called with consecutive chunks of every occurrence of the field. Returning false
+        // skips the rest of that occurrence, without a sink the payload is skipped entirely.
+        std::function<bool(const void *data, size_t size)> sink;
+
+        // Serialization: source has to write exactly size bytes to out. It is called once per
+        // serialization, the size passes of enclosing messages take size instead.
+        size_t size = 0;
+        std::function<void(writer &out)> source;
+    };
+
+    namespace detail
+    {
+        template<>
+        struct is_bytes<byte_stream> : public std::true_type
+        {};
+    }
+
+    template<>
+    struct serializer<byte_stream>
+    {
+        constexpr static const size_t chunk_size = 16 * 1024;
+
+        static void serialize(uint32_t tag, const byte_stream &value, flags_t<>, writer &out, bool force = false)
+        {
+            if (!force && value.size == 0) return;
+
+            detail::write_tag_wire_type(tag, WireType::LengthDelimeted, out);
+            detail::write_varint(value.size, out);
+            if (value.size == 0) return;
+
+            if (out.size_only)
+            {
+                out.write(nullptr, value.size);
+                return;
+            }
+
+            value.source(out);
+        }
+
+        static bool parse(WireType wire_type, byte_stream &value, flags_t<>, reader &in)
+        {
+            if (wire_type != WireType::LengthDelimeted) return false;
+
+            size_t size;
+            if (!detail::read_varint(size, in) || size > in.available_bytes()) return false;
+
+            bool accepted = static_cast<bool>(value.sink);
+
+            char chunk[chunk_size];
+            while (size > 0)
+            {
+                size_t part = std::min(size, chunk_size);
+                if (in.read(chunk, part) != part) return false;
+                if (accepted) accepted = value.sink(chunk, part);
+
+                size -= part;
+            }
+
+            return true;
+        }
+    };
+}
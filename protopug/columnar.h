@@ -0,0 +1,431 @@
+#pragma once
+
+// Columnar decoding of repeated message fields. Every singular scalar and string field of the
+// element type goes straight into its own column, no element structs are built. Encoding from
+// columns writes a repeated field that parses back to the same elements; it writes every value
+// marked present, defaults included, so its bytes can differ from those of the std::vector.
+
+#include "scan.h"
+
+#include <string_view>
+#include <type_traits>
+
+namespace protopug
+{
+    // Bit per row, set when the field was on the wire for that row
+    struct column_presence
+    {
+        bool present(size_t row) const
+        {
+            return (presence[row / 64] >> (row % 64)) & 1;
+        }
+
+        std::vector<uint64_t> presence;
+
+    protected:
+        void push_presence(size_t row, bool present)
+        {
+            if (row % 64 == 0) presence.push_back(0);
+            presence.back() |= static_cast<uint64_t>(present) << (row % 64);
+        }
+    };
+
+    // Absent fields hold the default value. bool values are stored as uint8_t.
+    template<class T>
+    struct column : public column_presence
+    {
+        using value_type = std::conditional_t<std::is_same_v<T, bool>, uint8_t, T>;
+
+        size_t size() const
+        {
+            return values.size();
+        }
+
+        void reserve(size_t rows)
+        {
+            values.reserve(rows);
+            presence.reserve((rows + 63) / 64);
+        }
+
+        void clear()
+        {
+            values.clear();
+            presence.clear();
+        }
+
+        void push_back(value_type value, bool present)
+        {
+            push_presence(values.size(), present);
+            values.push_back(value);
+        }
+
+        std::vector<value_type> values;
+    };
+
+    // Value of row i is data[offsets[i], offsets[i + 1]), absent fields are empty
+    template<>
+    struct column<std::string> : public column_presence
+    {
+        size_t size() const
+        {
+            return offsets.size() - 1;
+        }
+
+        std::string_view value(size_t row) const
+        {
+            return std::string_view(data).substr(offsets[row], offsets[row + 1] - offsets[row]);
+        }
+
+        void reserve(size_t rows)
+        {
+            offsets.reserve(rows + 1);
+            presence.reserve((rows + 63) / 64);
+        }
+
+        void clear()
+        {
+            offsets.assign(1, 0);
+            data.clear();
+            presence.clear();
+        }
+
+        void push_back(std::string_view value, bool present)
+        {
+            push_presence(size(), present);
+            data.append(value.data(), value.size());
+            offsets.push_back(data.size());
+        }
+
+        std::vector<uint64_t> offsets {0};
+        std::string data;
+    };
+
+    namespace detail
+    {
+        // Placeholder for fields that have no column: repeated, map, oneof and message fields
+        struct no_column
+        {
+            void reserve(size_t) {}
+            void clear() {}
+        };
+
+        template<class T, class Enable = void>
+        struct column_of_member
+        {
+            using type = no_column;
+        };
+
+        template<class T>
+        struct column_of_member<T, std::enable_if_t<std::is_arithmetic_v<T> || std::is_enum_v<T> || std::is_same_v<T, std::string>>>
+        {
+            using type = column<T>;
+        };
+
+        template<class T>
+        struct column_of_member<std::optional<T>> : public column_of_member<T>
+        {};
+
+        template<class Field>
+        struct column_of_field
+        {
+            using type = no_column;
+            using value_type = void;
+        };
+
+        template<uint32_t Tag, class MemPtrT, MemPtrT MemPtr, uint32_t Flags>
+        struct column_of_field<field_impl<Tag, MemPtrT, MemPtr, Flags>>
+        {
+            using type = typename column_of_member<typename field_impl<Tag, MemPtrT, MemPtr, Flags>::member_type>::type;
+            using value_type = typename scan_field_traits<field_impl<Tag, MemPtrT, MemPtr, Flags>>::type;
+        };
+
+        template<class Message>
+        struct column_set;
+
+        template<class... Fields>
+        struct column_set<message_impl<Fields...>>
+        {
+            constexpr static const size_t field_count = sizeof...(Fields);
+
+            template<uint32_t Tag>
+            constexpr static size_t index_of()
+            {
+                size_t index = field_count;
+                size_t i = 0;
+                ((index = (index == field_count && Fields::tag == Tag) ? i : index, ++i), ...);
+                return index;
+            }
+
+            // Appends one row decoded from an encoded element. Nothing is appended when it is
+            // malformed or a field has the wrong wire type.
+            bool append(const uint8_t *data, size_t size)
+            {
+                // Last occurrence of every field, like the parser
+                wire_record last[field_count];
+                bool found[field_count] = {};
+
+                const uint8_t *pos = data;
+                const uint8_t *end = data + size;
+                while (pos != end)
+                {
+                    wire_record record;
+                    if (!read_record(record, pos, end)) return false;
+
+                    size_t i = 0;
+                    ((Fields::tag == record.tag ? (last[i] = record, found[i] = true) : false, ++i), ...);
+                }
+
+                scan_value values[field_count];
+                if (!decode(last, found, values, std::index_sequence_for<Fields...>())) return false;
+
+                push_back(found, values, std::index_sequence_for<Fields...>());
+                ++rows;
+                return true;
+            }
+
+            // Encoded size of row, without tag and length prefix
+            size_t row_size(size_t row) const
+            {
+                writer_size_collector size_collector;
+                write_row(row, size_collector);
+                return size_collector.byte_size;
+            }
+
+            void write_row(size_t row, writer &out) const
+            {
+                write_row(row, out, std::index_sequence_for<Fields...>());
+            }
+
+            void reserve(size_t size)
+            {
+                std::apply([&](auto &... column)
+                {
+                    (column.reserve(size), ...);
+                }, columns);
+            }
+
+            void clear()
+            {
+                std::apply([&](auto &... column)
+                {
+                    (column.clear(), ...);
+                }, columns);
+                rows = 0;
+            }
+
+            std::tuple<typename column_of_field<Fields>::type...> columns;
+            size_t rows = 0;
+
+        private:
+            template<size_t... I>
+            bool decode(const wire_record *last, const bool *found, scan_value *values, std::index_sequence<I...>) const
+            {
+                return (decode_field<Fields>(last[I], found[I], values[I]) && ...);
+            }
+
+            template<class Field>
+            static bool decode_field(const wire_record &record, bool found, scan_value &value)
+            {
+                using Column = typename column_of_field<Field>::type;
+                using T = typename column_of_field<Field>::value_type;
+
+                if constexpr(std::is_same_v<Column, no_column>)
+                {
+                    return true;
+                }
+                else
+                {
+                    if (!found) return true;
+                    if (!decode_scan_value<T, Field::flags>(record, value)) return false;
+
+                    if constexpr(std::is_same_v<T, std::string> && (Field::flags & flags::utf8))
+                    {
+                        return is_valid_utf8(reinterpret_cast<const uint8_t *>(value.bytes.data()), value.bytes.size());
+                    }
+
+                    return true;
+                }
+            }
+
+            template<size_t... I>
+            void push_back(const bool *found, const scan_value *values, std::index_sequence<I...>)
+            {
+                (push_back_field<I, Fields>(found[I], values[I]), ...);
+            }
+
+            template<size_t I, class Field>
+            void push_back_field(bool found, const scan_value &value)
+            {
+                using Column = typename column_of_field<Field>::type;
+                using T = typename column_of_field<Field>::value_type;
+
+                auto &column = std::get<I>(columns);
+                if constexpr(std::is_same_v<Column, no_column>)
+                {
+                    (void) column;
+                }
+                else if constexpr(std::is_same_v<T, std::string>)
+                {
+                    column.push_back(value.bytes, found);
+                }
+                else if constexpr(scan_kind_of<T>() == scan_kind::floating_number)
+                {
+                    column.push_back(static_cast<T>(value.floating_number), found);
+                }
+                else if constexpr(scan_kind_of<T>() == scan_kind::unsigned_number)
+                {
+                    column.push_back(static_cast<typename Column::value_type>(value.unsigned_number), found);
+                }
+                else
+                {
+                    column.push_back(static_cast<T>(value.signed_number), found);
+                }
+            }
+
+            template<size_t... I>
+            void write_row(size_t row, writer &out, std::index_sequence<I...>) const
+            {
+                (write_field<I, Fields>(row, out), ...);
+            }
+
+            template<size_t I, class Field>
+            void write_field(size_t row, writer &out) const
+            {
+                using Column = typename column_of_field<Field>::type;
+                using T = typename column_of_field<Field>::value_type;
+
+                const auto &column = std::get<I>(columns);
+                if constexpr(!std::is_same_v<Column, no_column>)
+                {
+                    // Present defaults are written too, so that presence survives a round trip
+                    if (!column.present(row)) return;
+
+                    if constexpr(std::is_same_v<T, std::string>)
+                    {
+                        auto value = column.value(row);
+                        write_tag_wire_type(Field::tag, WireType::LengthDelimeted, out);
+                        write_varint(value.size(), out);
+                        out.write(value.data(), value.size());
+                    }
+                    else
+                    {
+                        serializer<T>::serialize(Field::tag, static_cast<T>(column.values[row]), flags_t<Field::flags>(), out, true);
+                    }
+                }
+            }
+        };
+    }
+
+    // Columns of every singular scalar and string field of Row, one row per element
+    template<class Row>
+    struct columns
+    {
+        template<uint32_t Tag>
+        auto &column()
+        {
+            return std::get<index_of<Tag>()>(_set.columns);
+        }
+
+        template<uint32_t Tag>
+        const auto &column() const
+        {
+            return std::get<index_of<Tag>()>(_set.columns);
+        }
+
+        size_t size() const
+        {
+            return _set.rows;
+        }
+
+        void reserve(size_t rows)
+        {
+            _set.reserve(rows);
+        }
+
+        void clear()
+        {
+            _set.clear();
+        }
+
+        // Appends the row of one encoded Row message, false when it is malformed
+        bool append_encoded(const uint8_t *data, size_t size)
+        {
+            return _set.append(data, size);
+        }
+
+        void serialize_row(size_t row, writer &out) const
+        {
+            _set.write_row(row, out);
+        }
+
+        size_t row_byte_size(size_t row) const
+        {
+            return _set.row_size(row);
+        }
+
+    private:
+        using set_type = detail::column_set<detail::flat_message_t<std::decay_t<decltype(descriptor<Row>::type())>>>;
+
+        template<uint32_t Tag>
+        constexpr static size_t index_of()
+        {
+            constexpr size_t index = set_type::template index_of<Tag>();
+            static_assert(index != set_type::field_count, "No field with this tag");
+            static_assert(!std::is_same_v<std::tuple_element_t<index, decltype(set_type::columns)>, detail::no_column>,
+                          "Only singular scalar and string fields have columns");
+            return index;
+        }
+
+        set_type _set;
+    };
+
+    namespace detail
+    {
+        template<class T, uint32_t Tag>
+        struct column_field_row
+        {
+            using field_type = typename message_field_with_tag<Tag, std::decay_t<decltype(descriptor<T>::type())>>::type;
+            static_assert(!std::is_void_v<field_type>, "No field with this tag");
+            static_assert(is_specialization_of<typename field_type::member_type, std::vector>::value, "Columns decode repeated message fields");
+
+            using type = typename field_type::member_type::value_type;
+        };
+    }
+
+    template<class T, uint32_t Tag>
+    using column_field_row_t = typename detail::column_field_row<T, Tag>::type;
+
+    // Decodes the elements of the repeated message field Tag of an encoded T into out, other fields
+    // of T are skipped. Rows are appended, false when the message is malformed.
+    template<class T, uint32_t Tag>
+    bool parse_columns(columns<column_field_row_t<T, Tag>> &out, std::string_view in)
+    {
+        auto pos = reinterpret_cast<const uint8_t *>(in.data());
+        auto end = pos + in.size();
+
+        while (pos != end)
+        {
+            detail::wire_record record;
+            if (!detail::read_record(record, pos, end)) return false;
+            if (record.tag != Tag) continue;
+
+            if (record.wire_type != WireType::LengthDelimeted || !out.append_encoded(record.data, record.size)) return false;
+        }
+
+        return true;
+    }
+
+    // Writes rows as the repeated field Tag of T. Fields without a column are not written. Every value
+    // marked present is written, defaults included, so a row parsed from an explicit 0 keeps it
+    // (08 00); serializing the std::vector of elements skips defaults instead, and the bytes differ.
+    template<class T, uint32_t Tag>
+    void serialize_columns(const columns<column_field_row_t<T, Tag>> &rows, writer &out)
+    {
+        for (size_t row = 0; row < rows.size(); ++row)
+        {
+            detail::write_tag_wire_type(Tag, WireType::LengthDelimeted, out);
+            detail::write_varint(rows.row_byte_size(row), out);
+            rows.serialize_row(row, out);
+        }
+    }
+}
@@ -0,0 +1,444 @@
+#pragma once
+
+// Streaming compression adapters for the writer/reader interfaces. Each codec is opt-in:
+// define PROTOPUG_WITH_ZLIB (link with -lz) and/or PROTOPUG_WITH_ZSTD (link with -lzstd)
+// before including this header.
+
+#include "protopug.h"
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+
+#if defined(PROTOPUG_WITH_ZLIB)
+#include <zlib.h>
+#endif
+
+#if defined(PROTOPUG_WITH_ZSTD)
+#include <zstd.h>
+#endif
+
+namespace protopug
+{
+    struct compression_stats
+    {
+        uint64_t uncompressed_bytes = 0;
+        uint64_t compressed_bytes = 0;
+        // Time spent inside the codec, not counting the wrapped writer/reader
+        std::chrono::nanoseconds codec_time {0};
+
+        double ratio() const
+        {
+            return compressed_bytes == 0 ? 0.0 : static_cast<double>(uncompressed_bytes) / compressed_bytes;
+        }
+
+        // Uncompressed bytes per second of codec time
+        double throughput() const
+        {
+            auto seconds = std::chrono::duration<double>(codec_time).count();
+            return seconds == 0.0 ? 0.0 : uncompressed_bytes / seconds;
+        }
+    };
+
+    namespace detail
+    {
+        // Codecs consume input and produce output until either side runs out:
+        //   bool process(const uint8_t *&in, size_t &in_size, uint8_t *&out, size_t &out_size, bool finish, bool &end)
+        // end is set once the whole stream has been produced (compressors only after finish).
+
+#if defined(PROTOPUG_WITH_ZLIB)
+        struct zlib_compressor
+        {
+            constexpr static const int default_level = Z_DEFAULT_COMPRESSION;
+
+            explicit zlib_compressor(int level)
+            {
+                _ok = deflateInit(&_stream, level) == Z_OK;
+            }
+
+            zlib_compressor(const zlib_compressor &) = delete;
+            zlib_compressor &operator=(const zlib_compressor &) = delete;
+
+            ~zlib_compressor()
+            {
+                if (_ok) deflateEnd(&_stream);
+            }
+
+            bool process(const uint8_t *&in, size_t &in_size, uint8_t *&out, size_t &out_size, bool finish, bool &end)
+            {
+                if (!_ok) return false;
+
+                uInt avail_in = static_cast<uInt>(std::min<size_t>(in_size, UINT_MAX));
+                uInt avail_out = static_cast<uInt>(std::min<size_t>(out_size, UINT_MAX));
+                _stream.next_in = const_cast<Bytef *>(in);
+                _stream.avail_in = avail_in;
+                _stream.next_out = out;
+                _stream.avail_out = avail_out;
+
+                int result = deflate(&_stream, finish ? Z_FINISH : Z_NO_FLUSH);
+
+                in += avail_in - _stream.avail_in;
+                in_size -= avail_in - _stream.avail_in;
+                out += avail_out - _stream.avail_out;
+                out_size -= avail_out - _stream.avail_out;
+
+                end = result == Z_STREAM_END;
+                return result == Z_OK || result == Z_STREAM_END || result == Z_BUF_ERROR;
+            }
+
+        private:
+            z_stream _stream {};
+            bool _ok;
+        };
+
+        struct zlib_decompressor
+        {
+            zlib_decompressor()
+            {
+                _ok = inflateInit(&_stream) == Z_OK;
+            }
+
+            zlib_decompressor(const zlib_decompressor &) = delete;
+            zlib_decompressor &operator=(const zlib_decompressor &) = delete;
+
+            ~zlib_decompressor()
+            {
+                if (_ok) inflateEnd(&_stream);
+            }
+
+            bool process(const uint8_t *&in, size_t &in_size, uint8_t *&out, size_t &out_size, bool /*finish*/, bool &end)
+            {
+                if (!_ok) return false;
+
+                uInt avail_in = static_cast<uInt>(std::min<size_t>(in_size, UINT_MAX));
+                uInt avail_out = static_cast<uInt>(std::min<size_t>(out_size, UINT_MAX));
+                _stream.next_in = const_cast<Bytef *>(in);
+                _stream.avail_in = avail_in;
+                _stream.next_out = out;
+                _stream.avail_out = avail_out;
+
+                int result = inflate(&_stream, Z_NO_FLUSH);
+
+                in += avail_in - _stream.avail_in;
+                in_size -= avail_in - _stream.avail_in;
+                out += avail_out - _stream.avail_out;
+                out_size -= avail_out - _stream.avail_out;
+
+                end = result == Z_STREAM_END;
+                return result == Z_OK || result == Z_STREAM_END || result == Z_BUF_ERROR;
+            }
+
+        private:
+            z_stream _stream {};
+            bool _ok;
+        };
+#endif
+
+#if defined(PROTOPUG_WITH_ZSTD)
+        struct zstd_compressor
+        {
+            constexpr static const int default_level = ZSTD_CLEVEL_DEFAULT;
+
+            explicit zstd_compressor(int level)
+                : _context(ZSTD_createCCtx())
+            {
+                if (_context)
+                {
+                    ZSTD_CCtx_setParameter(_context, ZSTD_c_compressionLevel, level);
+                }
+            }
+
+            zstd_compressor(const zstd_compressor &) = delete;
+            zstd_compressor &operator=(const zstd_compressor &) = delete;
+
+            ~zstd_compressor()
+            {
+                ZSTD_freeCCtx(_context);
+            }
+
+            bool process(const uint8_t *&in, size_t &in_size, uint8_t *&out, size_t &out_size, bool finish, bool &end)
+            {
+                if (!_context) return false;
+
+                ZSTD_inBuffer input {in, in_size, 0};
+                ZSTD_outBuffer output {out, out_size, 0};
+                size_t result = ZSTD_compressStream2(_context, &output, &input, finish ? ZSTD_e_end : ZSTD_e_continue);
+
+                in += input.pos;
+                in_size -= input.pos;
+                out += output.pos;
+                out_size -= output.pos;
+
+                if (ZSTD_isError(result)) return false;
+
+                end = finish && result == 0;
+                return true;
+            }
+
+        private:
+            ZSTD_CCtx *_context;
+        };
+
+        struct zstd_decompressor
+        {
+            zstd_decompressor()
+                : _context(ZSTD_createDCtx())
+            {}
+
+            zstd_decompressor(const zstd_decompressor &) = delete;
+            zstd_decompressor &operator=(const zstd_decompressor &) = delete;
+
+            ~zstd_decompressor()
+            {
+                ZSTD_freeDCtx(_context);
+            }
+
+            bool process(const uint8_t *&in, size_t &in_size, uint8_t *&out, size_t &out_size, bool /*finish*/, bool &end)
+            {
+                if (!_context) return false;
+
+                ZSTD_inBuffer input {in, in_size, 0};
+                ZSTD_outBuffer output {out, out_size, 0};
+                size_t result = ZSTD_decompressStream(_context, &output, &input);
+
+                in += input.pos;
+                in_size -= input.pos;
+                out += output.pos;
+                out_size -= output.pos;
+
+                if (ZSTD_isError(result)) return false;
+
+                end = result == 0;
+                return true;
+            }
+
+        private:
+            ZSTD_DCtx *_context;
+        };
+#endif
+    }
+
+    // Compresses everything written to it into out. Small writes of the encoder are gathered into
+    // a bounded input buffer first; finish() (or the destructor) ends the compressed stream. Call
+    // finish() to see errors, the destructor drops them and whatever out throws.
+    template<class Compressor>
+    struct compressing_writer : public writer
+    {
+        compressing_writer(writer &out, int level = Compressor::default_level, size_t buffer_size = 64 * 1024)
+            : _parent(out)
+            , _compressor(level)
+            , _in(buffer_size)
+            , _out(buffer_size)
+        {}
+
+        compressing_writer(const compressing_writer &) = delete;
+        compressing_writer &operator=(const compressing_writer &) = delete;
+
+        ~compressing_writer()
+        {
+            try
+            {
+                finish();
+            }
+            catch (...)
+            {
+            }
+        }
+
+        void write(const void *bytes, size_t size) override
+        {
+            auto data = reinterpret_cast<const uint8_t *>(bytes);
+
+            if (_in_size + size > _in.size())
+            {
+                compress(_in.data(), _in_size, false);
+                _in_size = 0;
+
+                if (size >= _in.size())
+                {
+                    compress(data, size, false);
+                    return;
+                }
+            }
+
+            std::memcpy(_in.data() + _in_size, data, size);
+            _in_size += size;
+        }
+
+        bool finish()
+        {
+            if (!_finished)
+            {
+                compress(_in.data(), _in_size, false);
+                _in_size = 0;
+                compress(nullptr, 0, true);
+                _finished = true;
+            }
+            return !_failed;
+        }
+
+        bool failed() const
+        {
+            return _failed;
+        }
+
+        const compression_stats &stats() const
+        {
+            return _stats;
+        }
+
+    private:
+        void compress(const uint8_t *data, size_t size, bool finish)
+        {
+            _stats.uncompressed_bytes += size;
+
+            bool end = false;
+            while (!_failed && (size > 0 || (finish && !end)))
+            {
+                uint8_t *out = _out.data();
+                size_t out_size = _out.size();
+
+                auto start = std::chrono::steady_clock::now();
+                if (!_compressor.process(data, size, out, out_size, finish, end))
+                {
+                    _failed = true;
+                }
+                _stats.codec_time += std::chrono::steady_clock::now() - start;
+
+                size_t produced = _out.size() - out_size;
+                if (produced > 0)
+                {
+                    _stats.compressed_bytes += produced;
+                    _parent.write(_out.data(), produced);
+                }
+            }
+        }
+
+        writer &_parent;
+        Compressor _compressor;
+        std::vector<uint8_t> _in;
+        std::vector<uint8_t> _out;
+        size_t _in_size = 0;
+        compression_stats _stats;
+        bool _finished = false;
+        bool _failed = false;
+    };
+
+    // Decompresses a stream read from in. Reads ahead up to buffer_size compressed bytes, so wrap
+    // the source into a limited reader if the compressed stream is followed by other data.
+    template<class Decompressor>
+    struct decompressing_reader : public reader
+    {
+        decompressing_reader(reader &in, size_t buffer_size = 64 * 1024)
+            : _parent(in)
+            , _in(buffer_size)
+            , _out(buffer_size)
+        {}
+
+        decompressing_reader(const decompressing_reader &) = delete;
+        decompressing_reader &operator=(const decompressing_reader &) = delete;
+
+        size_t read(void *bytes, size_t size) override
+        {
+            auto data = reinterpret_cast<uint8_t *>(bytes);
+
+            size_t read_size = 0;
+            while (read_size < size)
+            {
+                if (_out_pos != _out_end)
+                {
+                    size_t chunk = std::min(size - read_size, _out_end - _out_pos);
+                    std::memcpy(data + read_size, _out.data() + _out_pos, chunk);
+                    _out_pos += chunk;
+                    read_size += chunk;
+                    continue;
+                }
+
+                if (size - read_size >= _out.size())
+                {
+                    size_t produced = decompress(data + read_size, size - read_size);
+                    if (produced == 0) break;
+
+                    read_size += produced;
+                    continue;
+                }
+
+                _out_pos = 0;
+                _out_end = decompress(_out.data(), _out.size());
+                if (_out_end == 0) break;
+            }
+
+            return read_size;
+        }
+
+        // True once the end of the compressed stream has been reached
+        bool finished() const
+        {
+            return _end;
+        }
+
+        // Corrupted or truncated input
+        bool failed() const
+        {
+            return _failed;
+        }
+
+        const compression_stats &stats() const
+        {
+            return _stats;
+        }
+
+    private:
+        size_t decompress(uint8_t *out, size_t out_size)
+        {
+            size_t available = out_size;
+            while (available == out_size && !_end && !_failed)
+            {
+                if (_in_size == 0)
+                {
+                    _in_pos = _in.data();
+                    _in_size = _parent.read(_in.data(), _in.size());
+                    _stats.compressed_bytes += _in_size;
+                    if (_in_size == 0)
+                    {
+                        _failed = true;
+                        break;
+                    }
+                }
+
+                auto start = std::chrono::steady_clock::now();
+                if (!_decompressor.process(_in_pos, _in_size, out, available, false, _end))
+                {
+                    _failed = true;
+                }
+                _stats.codec_time += std::chrono::steady_clock::now() - start;
+            }
+
+            size_t produced = out_size - available;
+            _stats.uncompressed_bytes += produced;
+            return produced;
+        }
+
+        reader &_parent;
+        Decompressor _decompressor;
+        std::vector<uint8_t> _in;
+        std::vector<uint8_t> _out;
+        const uint8_t *_in_pos = nullptr;
+        size_t _in_size = 0;
+        size_t _out_pos = 0;
+        size_t _out_end = 0;
+        compression_stats _stats;
+        bool _end = false;
+        bool _failed = false;
+    };
+
+#if defined(PROTOPUG_WITH_ZLIB)
+    using zlib_writer = compressing_writer<detail::zlib_compressor>;
+    using zlib_reader = decompressing_reader<detail::zlib_decompressor>;
+#endif
+
+#if defined(PROTOPUG_WITH_ZSTD)
+    using zstd_writer = compressing_writer<detail::zstd_compressor>;
+    using zstd_reader = decompressing_reader<detail::zstd_decompressor>;
+#endif
+}
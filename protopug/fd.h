@@ -0,0 +1,515 @@
+#pragma once
+
+// Buffered writer/reader over a file descriptor (POSIX). Two buffers take turns: the encoder fills
+// one while the other is written out in the background, reads run one buffer ahead of the decoder.
+// I/O goes through a worker thread doing pwrite/pread by default, define PROTOPUG_WITH_IO_URING
+// (link with -luring) before including this header to submit it to io_uring instead.
+
+#include "protopug.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(PROTOPUG_WITH_IO_URING)
+#include <liburing.h>
+#endif
+
+namespace protopug
+{
+    namespace detail
+    {
+        // I/O backends run one operation at a time:
+        //   void start_write(int fd, const uint8_t *data, size_t size, int64_t offset)
+        //   void start_read(int fd, uint8_t *data, size_t size, int64_t offset)
+        //   ssize_t wait()
+        // wait() returns the bytes transferred or -errno. Writes are complete unless they fail, reads
+        // may come back short and return 0 at the end of the file. A negative offset means the
+        // current file position, for pipes and sockets.
+
+        ssize_t write_fully(int fd, const uint8_t *data, size_t size, int64_t offset)
+        {
+            size_t written = 0;
+            while (written < size)
+            {
+                ssize_t result = offset < 0 ? ::write(fd, data + written, size - written)
+                                 : ::pwrite(fd, data + written, size - written, static_cast<off_t>(offset + written));
+                if (result < 0)
+                {
+                    if (errno == EINTR) continue;
+                    return -errno;
+                }
+
+                written += static_cast<size_t>(result);
+            }
+
+            return static_cast<ssize_t>(written);
+        }
+
+        ssize_t read_once(int fd, uint8_t *data, size_t size, int64_t offset)
+        {
+            for (;;)
+            {
+                ssize_t result = offset < 0 ? ::read(fd, data, size) : ::pread(fd, data, size, static_cast<off_t>(offset));
+                if (result >= 0) return result;
+                if (errno != EINTR) return -errno;
+            }
+        }
+
+        struct thread_io
+        {
+            thread_io()
+                : _thread(&thread_io::run, this)
+            {}
+
+            thread_io(const thread_io &) = delete;
+            thread_io &operator=(const thread_io &) = delete;
+
+            ~thread_io()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _stop = true;
+                }
+                _condition.notify_all();
+                _thread.join();
+            }
+
+            void start_write(int fd, const uint8_t *data, size_t size, int64_t offset)
+            {
+                start(true, fd, const_cast<uint8_t *>(data), size, offset);
+            }
+
+            void start_read(int fd, uint8_t *data, size_t size, int64_t offset)
+            {
+                start(false, fd, data, size, offset);
+            }
+
+            ssize_t wait()
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _condition.wait(lock, [&]
+                {
+                    return _done;
+                });
+                return _result;
+            }
+
+        private:
+            void start(bool write, int fd, uint8_t *data, size_t size, int64_t offset)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _write = write;
+                    _fd = fd;
+                    _data = data;
+                    _size = size;
+                    _offset = offset;
+                    _started = true;
+                    _done = false;
+                }
+                _condition.notify_all();
+            }
+
+            void run()
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                for (;;)
+                {
+                    _condition.wait(lock, [&]
+                    {
+                        return _started || _stop;
+                    });
+                    if (!_started) return;
+
+                    _started = false;
+                    lock.unlock();
+
+                    ssize_t result = _write ? write_fully(_fd, _data, _size, _offset) : read_once(_fd, _data, _size, _offset);
+
+                    lock.lock();
+                    _result = result;
+                    _done = true;
+                    _condition.notify_all();
+                }
+            }
+
+            std::mutex _mutex;
+            std::condition_variable _condition;
+
+            bool _write = false;
+            int _fd = -1;
+            uint8_t *_data = nullptr;
+            size_t _size = 0;
+            int64_t _offset = 0;
+
+            bool _started = false;
+            bool _done = true;
+            bool _stop = false;
+            ssize_t _result = 0;
+
+            std::thread _thread;
+        };
+
+#if defined(PROTOPUG_WITH_IO_URING)
+        struct uring_io
+        {
+            uring_io()
+            {
+                _ok = io_uring_queue_init(2, &_ring, 0) == 0;
+            }
+
+            uring_io(const uring_io &) = delete;
+            uring_io &operator=(const uring_io &) = delete;
+
+            ~uring_io()
+            {
+                if (!_ok) return;
+
+                wait();
+                io_uring_queue_exit(&_ring);
+            }
+
+            void start_write(int fd, const uint8_t *data, size_t size, int64_t offset)
+            {
+                _write = true;
+                start(fd, const_cast<uint8_t *>(data), size, offset);
+            }
+
+            void start_read(int fd, uint8_t *data, size_t size, int64_t offset)
+            {
+                _write = false;
+                start(fd, data, size, offset);
+            }
+
+            ssize_t wait()
+            {
+                while (_pending)
+                {
+                    io_uring_cqe *cqe;
+                    int error = io_uring_wait_cqe(&_ring, &cqe);
+                    if (error == -EINTR) continue;
+                    if (error < 0)
+                    {
+                        _pending = false;
+                        return error;
+                    }
+
+                    int result = cqe->res;
+                    io_uring_cqe_seen(&_ring, cqe);
+                    _pending = false;
+
+                    if (result == -EINTR || result == -EAGAIN)
+                    {
+                        submit();
+                        continue;
+                    }
+                    if (result < 0) return result;
+                    if (_write && result == 0) return -EIO;
+
+                    _transferred += static_cast<size_t>(result);
+
+                    // Short writes go on with the rest
+                    if (_write && result > 0 && _transferred < _size)
+                    {
+                        submit();
+                        continue;
+                    }
+                }
+
+                return _failed ? _failed : static_cast<ssize_t>(_transferred);
+            }
+
+        private:
+            void start(int fd, uint8_t *data, size_t size, int64_t offset)
+            {
+                _fd = fd;
+                _data = data;
+                _size = size;
+                _offset = offset;
+                _transferred = 0;
+                _failed = _ok ? 0 : -ENOSYS;
+
+                if (_ok) submit();
+            }
+
+            void submit()
+            {
+                io_uring_sqe *sqe = io_uring_get_sqe(&_ring);
+                if (!sqe)
+                {
+                    _failed = -EBUSY;
+                    return;
+                }
+
+                auto offset = _offset < 0 ? static_cast<uint64_t>(-1) : static_cast<uint64_t>(_offset) + _transferred;
+                auto size = static_cast<unsigned>(std::min<size_t>(_size - _transferred, UINT32_MAX));
+                if (_write)
+                {
+                    io_uring_prep_write(sqe, _fd, _data + _transferred, size, offset);
+                }
+                else
+                {
+                    io_uring_prep_read(sqe, _fd, _data + _transferred, size, offset);
+                }
+
+                int submitted = io_uring_submit(&_ring);
+                if (submitted == 1)
+                {
+                    _pending = true;
+                }
+                else
+                {
+                    _failed = submitted < 0 ? submitted : -EIO;
+                }
+            }
+
+            io_uring _ring {};
+            bool _ok;
+
+            bool _write = false;
+            int _fd = -1;
+            uint8_t *_data = nullptr;
+            size_t _size = 0;
+            int64_t _offset = 0;
+            size_t _transferred = 0;
+
+            bool _pending = false;
+            ssize_t _failed = 0;
+        };
+
+        using default_fd_io = uring_io;
+#else
+        using default_fd_io = thread_io;
+#endif
+
+        // Current position of fd, -1 when it can't seek
+        int64_t fd_position(int fd)
+        {
+            return static_cast<int64_t>(::lseek(fd, 0, SEEK_CUR));
+        }
+    }
+
+    // Writes to fd starting at its current position, the descriptor stays owned by the caller.
+    // flush() (or the destructor) writes out what is left and moves the file position behind it,
+    // writes in between don't move it.
+    template<class IO>
+    struct basic_fd_writer : public writer
+    {
+        explicit basic_fd_writer(int fd, size_t buffer_size = 1024 * 1024)
+            : _fd(fd)
+            , _offset(detail::fd_position(fd))
+            , _buffers {std::vector<uint8_t>(buffer_size), std::vector<uint8_t>(buffer_size)}
+        {}
+
+        basic_fd_writer(const basic_fd_writer &) = delete;
+        basic_fd_writer &operator=(const basic_fd_writer &) = delete;
+
+        ~basic_fd_writer()
+        {
+            flush();
+        }
+
+        void write(const void *bytes, size_t size) override
+        {
+            auto data = reinterpret_cast<const uint8_t *>(bytes);
+
+            while (size > 0)
+            {
+                auto &buffer = _buffers[_current];
+                size_t chunk = std::min(size, buffer.size() - _size);
+                std::memcpy(buffer.data() + _size, data, chunk);
+                _size += chunk;
+                data += chunk;
+                size -= chunk;
+
+                if (_size == buffer.size()) swap();
+            }
+        }
+
+        // False once a write has failed
+        bool flush()
+        {
+            if (_size > 0) swap();
+            finish_pending();
+
+            if (_offset >= 0 && !_failed && ::lseek(_fd, static_cast<off_t>(_offset), SEEK_SET) < 0)
+            {
+                _failed = true;
+                _error = errno;
+            }
+            return !_failed;
+        }
+
+        bool failed() const
+        {
+            return _failed;
+        }
+
+        // errno of the first failed write
+        int error() const
+        {
+            return _error;
+        }
+
+    private:
+        // Hands the current buffer to the backend and continues in the other one
+        void swap()
+        {
+            finish_pending();
+
+            if (!_failed)
+            {
+                _io.start_write(_fd, _buffers[_current].data(), _size, _offset);
+                _pending = true;
+                if (_offset >= 0) _offset += _size;
+            }
+
+            _current ^= 1;
+            _size = 0;
+        }
+
+        void finish_pending()
+        {
+            if (!_pending) return;
+
+            _pending = false;
+            ssize_t result = _io.wait();
+            if (result < 0 && !_failed)
+            {
+                _failed = true;
+                _error = static_cast<int>(-result);
+            }
+        }
+
+        int _fd;
+        int64_t _offset;
+        IO _io;
+        std::vector<uint8_t> _buffers[2];
+        size_t _current = 0;
+        size_t _size = 0;
+        bool _pending = false;
+        bool _failed = false;
+        int _error = 0;
+    };
+
+    // Reads fd from its current position, the descriptor stays owned by the caller. The next buffer
+    // is read while the current one is decoded, the destructor moves the file position behind the
+    // bytes that were consumed.
+    template<class IO>
+    struct basic_fd_reader : public reader
+    {
+        explicit basic_fd_reader(int fd, size_t buffer_size = 1024 * 1024)
+            : _fd(fd)
+            , _offset(detail::fd_position(fd))
+            , _buffers {std::vector<uint8_t>(buffer_size), std::vector<uint8_t>(buffer_size)}
+        {
+            struct stat file_stat;
+            if (_offset >= 0 && ::fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) && file_stat.st_size >= _offset)
+            {
+                _available = static_cast<size_t>(file_stat.st_size - _offset);
+            }
+
+            start_read(0);
+        }
+
+        basic_fd_reader(const basic_fd_reader &) = delete;
+        basic_fd_reader &operator=(const basic_fd_reader &) = delete;
+
+        ~basic_fd_reader()
+        {
+            if (_pending) _io.wait();
+
+            // _offset is behind the buffer being decoded
+            if (_offset >= 0) ::lseek(_fd, static_cast<off_t>(_offset - static_cast<int64_t>(_end - _pos)), SEEK_SET);
+        }
+
+        size_t read(void *bytes, size_t size) override
+        {
+            auto data = reinterpret_cast<uint8_t *>(bytes);
+
+            size_t read_size = 0;
+            while (read_size < size)
+            {
+                if (_pos == _end && !next_buffer()) break;
+
+                size_t chunk = std::min(size - read_size, _end - _pos);
+                std::memcpy(data + read_size, _buffers[_current].data() + _pos, chunk);
+                _pos += chunk;
+                read_size += chunk;
+            }
+
+            if (_available != SIZE_MAX) _available -= read_size;
+            return read_size;
+        }
+
+        // Bytes left in a regular file, unbounded for pipes and sockets
+        size_t available_bytes() const override
+        {
+            return _available;
+        }
+
+        bool failed() const
+        {
+            return _failed;
+        }
+
+        // errno of the first failed read
+        int error() const
+        {
+            return _error;
+        }
+
+    private:
+        void start_read(size_t index)
+        {
+            _io.start_read(_fd, _buffers[index].data(), _buffers[index].size(), _offset);
+            _pending = true;
+        }
+
+        // Switches to the buffer that was read ahead and starts reading into the drained one
+        bool next_buffer()
+        {
+            if (!_pending) return false;
+
+            _pending = false;
+            ssize_t result = _io.wait();
+            if (result < 0)
+            {
+                _failed = true;
+                _error = static_cast<int>(-result);
+                return false;
+            }
+            if (result == 0) return false;
+
+            if (_offset >= 0) _offset += result;
+
+            _current ^= 1;
+            _pos = 0;
+            _end = static_cast<size_t>(result);
+
+            start_read(_current ^ 1);
+            return true;
+        }
+
+        int _fd;
+        int64_t _offset;
+        IO _io;
+        std::vector<uint8_t> _buffers[2];
+        size_t _current = 1;
+        size_t _pos = 0;
+        size_t _end = 0;
+        size_t _available = SIZE_MAX;
+        bool _pending = false;
+        bool _failed = false;
+        int _error = 0;
+    };
+
+    using fd_writer = basic_fd_writer<detail::default_fd_io>;
+    using fd_reader = basic_fd_reader<detail::default_fd_io>;
+}
@@ -0,0 +1,185 @@
+#pragma once
+
+// Whole-file parse/serialize through memory mappings (POSIX)
+
+#include "protopug.h"
+
+#include <atomic>
+#include <climits>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace protopug
+{
+    namespace detail
+    {
+        struct file_descriptor
+        {
+            explicit file_descriptor(int fd)
+                : fd(fd)
+            {}
+
+            file_descriptor(const file_descriptor &) = delete;
+            file_descriptor &operator=(const file_descriptor &) = delete;
+
+            ~file_descriptor()
+            {
+                if (fd >= 0) ::close(fd);
+            }
+
+            int fd;
+        };
+
+        struct file_mapping
+        {
+            file_mapping(int fd, size_t size, int protection)
+                : size(size)
+            {
+                if (size == 0) return;
+
+                void *address = ::mmap(nullptr, size, protection, protection & PROT_WRITE ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+                if (address != MAP_FAILED)
+                {
+                    data = address;
+                }
+            }
+
+            file_mapping(const file_mapping &) = delete;
+            file_mapping &operator=(const file_mapping &) = delete;
+
+            ~file_mapping()
+            {
+                if (data) ::munmap(data, size);
+            }
+
+            bool valid() const
+            {
+                return size == 0 || data != nullptr;
+            }
+
+            void *data = nullptr;
+            size_t size;
+        };
+
+        std::string parent_directory(const std::string &path)
+        {
+            size_t slash = path.rfind('/');
+            if (slash == std::string::npos) return ".";
+            return slash == 0 ? "/" : path.substr(0, slash);
+        }
+
+        // The file a chain of symbolic links at path ends in, empty when the chain doesn't end
+        std::string resolve_symlinks(std::string path)
+        {
+            for (int depth = 0; depth < 40; ++depth)
+            {
+                struct stat link_stat;
+                if (::lstat(path.c_str(), &link_stat) != 0 || !S_ISLNK(link_stat.st_mode)) return path;
+
+                char target[PATH_MAX];
+                ssize_t size = ::readlink(path.c_str(), target, sizeof(target));
+                if (size < 0 || static_cast<size_t>(size) == sizeof(target)) return std::string();
+
+                if (target[0] == '/' || path.find('/') == std::string::npos)
+                {
+                    path.assign(target, static_cast<size_t>(size));
+                }
+                else
+                {
+                    path = parent_directory(path) + "/" + std::string(target, static_cast<size_t>(size));
+                }
+            }
+
+            return std::string();
+        }
+    }
+
+    // Parses straight out of a read-only mapping of the file, without reading it into memory first
+    template <class T>
+    bool parse_from_file(T &value, const std::string &path)
+    {
+        detail::file_descriptor file(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        if (file.fd < 0) return false;
+
+        struct stat file_stat;
+        if (::fstat(file.fd, &file_stat) != 0) return false;
+
+        if (file_stat.st_size == 0) return true;
+
+        detail::file_mapping mapping(file.fd, static_cast<size_t>(file_stat.st_size), PROT_READ);
+        if (!mapping.valid()) return false;
+
+        ::madvise(mapping.data, mapping.size, MADV_SEQUENTIAL);
+
+        buffer_reader buffer_in(mapping.data, mapping.size);
+        return parse_from_reader(value, buffer_in);
+    }
+
+    // Encodes into a shared mapping of a temporary file next to path, which replaces path once it is
+    // complete. The space is allocated up front, so a full disk makes this return false instead of
+    // faulting on the mapping, and path keeps its old content on any failure before the rename.
+    // The file is replaced, not overwritten: when path is a symbolic link the file it points to is
+    // replaced, mode and owner (as far as the process may set it) are carried over, but ACLs,
+    // extended attributes and other hard links to the old file are not. The directory is synced
+    // after the rename, false after it means only that the rename may not be durable yet.
+    template <class T>
+    bool serialize_to_file(const T &value, const std::string &path)
+    {
+        detail::writer_size_collector size_collector;
+        serialize_to_writer(value, size_collector);
+
+        std::string target_path = detail::resolve_symlinks(path);
+        if (target_path.empty()) return false;
+
+        static std::atomic<unsigned> temporary_count {0};
+        std::string temporary_path = target_path + ".tmp." + std::to_string(::getpid()) + "." + std::to_string(temporary_count++);
+
+        detail::file_descriptor file(::open(temporary_path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666));
+        if (file.fd < 0) return false;
+
+        bool written = [&]
+        {
+            struct stat target_stat;
+            if (::stat(target_path.c_str(), &target_stat) == 0)
+            {
+                // Owner first, changing it may clear setuid and setgid bits. Without the right to
+                // change it the file keeps the owner and group of the process.
+                if (::fchown(file.fd, target_stat.st_uid, target_stat.st_gid) != 0
+                    && ::fchown(file.fd, static_cast<uid_t>(-1), target_stat.st_gid) != 0)
+                {
+                }
+                if (::fchmod(file.fd, target_stat.st_mode & 07777) != 0) return false;
+            }
+
+            if (size_collector.byte_size > 0 && ::posix_fallocate(file.fd, 0, static_cast<off_t>(size_collector.byte_size)) != 0) return false;
+
+            detail::file_mapping mapping(file.fd, size_collector.byte_size, PROT_READ | PROT_WRITE);
+            if (!mapping.valid()) return false;
+
+            if (mapping.data)
+            {
+                ::madvise(mapping.data, mapping.size, MADV_SEQUENTIAL);
+            }
+
+            buffer_writer buffer_out(mapping.data, mapping.size);
+            serialize_to_writer(value, buffer_out);
+
+            return !buffer_out.overflow() && buffer_out.size() == mapping.size;
+        }();
+
+        // The data has to be on disk before the rename makes it visible
+        if (!written || ::fsync(file.fd) != 0 || ::rename(temporary_path.c_str(), target_path.c_str()) != 0)
+        {
+            ::unlink(temporary_path.c_str());
+            return false;
+        }
+
+        // And the rename has to be on disk before the file counts as written
+        detail::file_descriptor directory(::open(detail::parent_directory(target_path).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        return directory.fd >= 0 && ::fsync(directory.fd) == 0;
+    }
+}
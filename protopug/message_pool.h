@@ -0,0 +1,243 @@
+#pragma once
+
+// Pool of message instances for servers that parse into the same types over and over. Every
+// thread keeps its own free list, objects released on another thread are handed back to the
+// owning thread through a lock-free stack. Released objects are reset through the descriptor,
+// strings and containers keep their capacity.
+
+#include "protopug.h"
+
+#include <atomic>
+#include <memory>
+#include <type_traits>
+
+namespace protopug
+{
+    namespace detail
+    {
+        template<class T>
+        void reset_fields(T &value);
+
+        template<class T>
+        void reset_member(T &value, const T &initial)
+        {
+            if constexpr(std::is_arithmetic_v<T> || std::is_enum_v<T> || is_specialization_of<T, std::variant>::value)
+            {
+                value = initial;
+            }
+            else if constexpr(std::is_same_v<T, std::string> || is_specialization_of<T, std::vector>::value
+                              || is_specialization_of<T, std::map>::value)
+            {
+                value.clear();
+            }
+            else if constexpr(is_bytes<T>::value)
+            {
+                value = initial;
+            }
+            else if constexpr(is_specialization_of<T, std::optional>::value)
+            {
+                value.reset();
+            }
+            else
+            {
+                reset_fields(value);
+            }
+        }
+
+        template<class T>
+        void reset_fields(T &value)
+        {
+            // Scalars go back to their default member initializers
+            static const T initial {};
+
+            message_type<T>().visit([&](const auto & field)
+            {
+                using Field = std::decay_t<decltype(field)>;
+                reset_member(Field::get(value), Field::get(initial));
+            });
+        }
+    }
+
+    // Resets all fields in the descriptor of value without releasing memory held by strings and
+    // containers. Members that are not in the descriptor are left alone.
+    template<class T>
+    void reset_message(T &value)
+    {
+        detail::reset_fields(value);
+    }
+
+    // Up to MaxCached free objects are kept per thread
+    template<class T, size_t MaxCached = 1024>
+    class message_pool
+    {
+        struct thread_cache;
+
+        struct node
+        {
+            T value {};
+            thread_cache *owner;
+            node *next = nullptr;
+        };
+
+        struct thread_cache
+        {
+            node *local = nullptr;
+            size_t local_size = 0;
+            // Objects released by other threads
+            std::atomic<node *> remote {nullptr};
+            // The thread itself plus every node allocated for it
+            std::atomic<size_t> references {1};
+        };
+
+    public:
+        struct deleter
+        {
+            void operator()(T * /*value*/) const
+            {
+                release(item);
+            }
+
+            node *item;
+        };
+
+        using pointer = std::unique_ptr<T, deleter>;
+
+        static pointer acquire()
+        {
+            thread_cache &cache = local_cache();
+
+            if (!cache.local)
+            {
+                take_remote(cache);
+            }
+
+            node *item = cache.local;
+            if (item)
+            {
+                cache.local = item->next;
+                --cache.local_size;
+            }
+            else
+            {
+                item = new node;
+                item->owner = &cache;
+                cache.references.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            return pointer(&item->value, deleter {item});
+        }
+
+    private:
+        struct cache_holder
+        {
+            cache_holder()
+            {
+                _current = cache;
+            }
+
+            ~cache_holder()
+            {
+                _current = nullptr;
+                close(cache);
+            }
+
+            thread_cache *cache = new thread_cache;
+        };
+
+        static thread_cache &local_cache()
+        {
+            thread_local cache_holder holder;
+            return *holder.cache;
+        }
+
+        // Marks the remote stack of a cache whose thread has exited
+        static node *closed()
+        {
+            return reinterpret_cast<node *>(alignof(node));
+        }
+
+        static void unreference(thread_cache *cache)
+        {
+            if (cache->references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                delete cache;
+            }
+        }
+
+        static void free_node(node *item)
+        {
+            thread_cache *owner = item->owner;
+            delete item;
+            unreference(owner);
+        }
+
+        static void free_list(node *item)
+        {
+            while (item)
+            {
+                node *next = item->next;
+                free_node(item);
+                item = next;
+            }
+        }
+
+        static void push_local(thread_cache &cache, node *item)
+        {
+            if (cache.local_size >= MaxCached)
+            {
+                free_node(item);
+                return;
+            }
+
+            item->next = cache.local;
+            cache.local = item;
+            ++cache.local_size;
+        }
+
+        static void take_remote(thread_cache &cache)
+        {
+            node *item = cache.remote.exchange(nullptr, std::memory_order_acquire);
+            while (item)
+            {
+                node *next = item->next;
+                push_local(cache, item);
+                item = next;
+            }
+        }
+
+        static void release(node *item)
+        {
+            reset_message(item->value);
+
+            thread_cache *owner = item->owner;
+            if (owner == _current)
+            {
+                push_local(*owner, item);
+                return;
+            }
+
+            node *head = owner->remote.load(std::memory_order_relaxed);
+            do
+            {
+                if (head == closed())
+                {
+                    free_node(item);
+                    return;
+                }
+
+                item->next = head;
+            }
+            while (!owner->remote.compare_exchange_weak(head, item, std::memory_order_release, std::memory_order_relaxed));
+        }
+
+        static void close(thread_cache *cache)
+        {
+            free_list(cache->remote.exchange(closed(), std::memory_order_acquire));
+            free_list(cache->local);
+            cache->local = nullptr;
+            unreference(cache);
+        }
+
+        static inline thread_local thread_cache *_current = nullptr;
+    };
+}
@@ -0,0 +1,431 @@
+#pragma once
+
+// Table driven parser. Every message type gets one parse_table built from descriptor<T> on first
+// use: field offset, decoder kind and, for message fields, the table of the field type. A single
+// interpreter loop runs over the tables, so scalar, string and message fields of all types share
+// the same code instead of each instantiating its own serializer graph. Shapes without a decoder
+// kind (repeated scalars, maps, oneofs, optionals) go through a small per-type function.
+
+#include "protopug.h"
+
+#include <algorithm>
+#include <type_traits>
+
+namespace protopug
+{
+    namespace detail
+    {
+        enum class parse_kind : uint8_t
+        {
+            varint32,
+            varint64,
+            zigzag32,
+            zigzag64,
+            fixed32,
+            fixed64,
+            boolean,
+            string,
+            utf8_string,
+            message,
+            custom,
+        };
+
+        struct parse_table;
+
+        using parse_table_getter = const parse_table &(*)();
+        using parse_function = bool (*)(void *field, WireType wire_type, reader &in);
+
+        struct parse_entry
+        {
+            uint32_t tag;
+            uint32_t offset;
+            union
+            {
+                parse_table_getter table;
+                parse_function parse;
+            };
+            parse_kind kind;
+        };
+
+        struct parse_table
+        {
+            std::vector<parse_entry> entries;
+            // Entry index + 1 by tag, when tags are dense enough
+            std::vector<uint16_t> index;
+
+            const parse_entry *find(uint32_t tag) const
+            {
+                if (tag < index.size())
+                {
+                    auto i = index[tag];
+                    return i == 0 ? nullptr : &entries[i - 1];
+                }
+
+                auto it = std::lower_bound(entries.begin(), entries.end(), tag, [](const parse_entry & entry, uint32_t tag)
+                {
+                    return entry.tag < tag;
+                });
+                return it != entries.end() && it->tag == tag ? &*it : nullptr;
+            }
+        };
+
+        template<class T>
+        constexpr bool is_message_v = !std::is_arithmetic_v<T> && !std::is_enum_v<T> && !is_bytes<T>::value
+                                      && !is_specialization_of<T, std::vector>::value && !is_specialization_of<T, std::optional>::value
+                                      && !is_specialization_of<T, std::variant>::value && !is_specialization_of<T, std::map>::value;
+
+        template<class T>
+        const parse_table &parse_table_of();
+
+        bool table_read_message(void *value, const parse_table &table, reader &in);
+
+        bool table_read_sub_message(void *value, const parse_table &table, WireType wire_type, reader &in)
+        {
+            if (wire_type != WireType::LengthDelimeted) return false;
+
+            size_t size;
+            if (!read_varint(size, in) || size > in.available_bytes()) return false;
+
+            limited_reader limited_in(in, size);
+            if (in.budget && !in.budget->enter()) return false;
+
+            bool result = table_read_message(value, table, limited_in) && limited_in.available_bytes() == 0;
+            if (in.budget) in.budget->leave();
+            return result;
+        }
+
+        template<class T, uint32_t Flags>
+        bool read_value(T &value, WireType wire_type, reader &in)
+        {
+            if constexpr(is_message_v<T>)
+            {
+                return table_read_sub_message(&value, parse_table_of<T>(), wire_type, in);
+            }
+            else
+            {
+                return serializer<T>::parse(wire_type, value, flags_t<Flags>(), in);
+            }
+        }
+
+        template<class T, uint32_t Flags>
+        bool table_read_repeated(void *field, WireType wire_type, reader &in)
+        {
+            auto &value = *static_cast<std::vector<T> *>(field);
+            if constexpr(is_message_v<T>)
+            {
+                if (in.budget && !in.budget->allocate_elements(value.size(), value.size() + 1, sizeof(T))) return false;
+
+                return table_read_sub_message(&value.emplace_back(), parse_table_of<T>(), wire_type, in);
+            }
+            else
+            {
+                return serializer<std::vector<T>>::parse(wire_type, value, flags_t<Flags>(), in);
+            }
+        }
+
+        // Bytes members with their own serializer, like byte_stream
+        template<class T, uint32_t Flags>
+        bool table_read_bytes(void *field, WireType wire_type, reader &in)
+        {
+            return serializer<T>::parse(wire_type, *static_cast<T *>(field), flags_t<Flags>(), in);
+        }
+
+        template<class T, uint32_t Flags>
+        bool table_read_optional(void *field, WireType wire_type, reader &in)
+        {
+            return read_value<T, Flags>(static_cast<std::optional<T> *>(field)->emplace(), wire_type, in);
+        }
+
+        template<class Variant, size_t Index, uint32_t Flags>
+        bool table_read_oneof(void *field, WireType wire_type, reader &in)
+        {
+            using T = std::variant_alternative_t<Index, Variant>;
+            auto &variant = *static_cast<Variant *>(field);
+            return read_value<T, Flags>(variant.index() == Index ? *std::get_if<Index>(&variant) : variant.template emplace<Index>(), wire_type, in);
+        }
+
+        template<class Map, uint32_t KeyFlags, uint32_t ValueFlags>
+        bool table_read_map(void *field, WireType wire_type, reader &in)
+        {
+            if (wire_type != WireType::LengthDelimeted) return false;
+
+            size_t size;
+            if (!read_varint(size, in) || size > in.available_bytes()) return false;
+
+            limited_reader limited_in(in, size);
+
+            typename Map::key_type key {};
+            typename Map::mapped_type value {};
+
+            uint32_t tag_key;
+            while (limited_in.available_bytes() > 0 && read_varint(tag_key, limited_in))
+            {
+                uint32_t tag;
+                WireType entry_wire_type;
+                read_tag_wire_type(tag_key, tag, entry_wire_type);
+
+                bool result;
+                switch (tag)
+                {
+                case 1:
+                    result = read_value<typename Map::key_type, KeyFlags>(key, entry_wire_type, limited_in);
+                    break;
+                case 2:
+                    result = read_value<typename Map::mapped_type, ValueFlags>(value, entry_wire_type, limited_in);
+                    break;
+                default:
+                    result = skip_field(entry_wire_type, limited_in);
+                    break;
+                }
+
+                if (!result) return false;
+            }
+
+            if (limited_in.available_bytes() != 0) return false;
+
+            auto &map = *static_cast<Map *>(field);
+            size_t old_size = map.size();
+            map.emplace_hint(map.end(), std::move(key), std::move(value));
+
+            return !in.budget || in.budget->allocate_elements(old_size, map.size(), sizeof(typename Map::value_type));
+        }
+
+        template<class T, uint32_t Flags>
+        void set_parse_kind(parse_entry &entry)
+        {
+            if constexpr(std::is_same_v<T, bool>)
+            {
+                entry.kind = parse_kind::boolean;
+            }
+            else if constexpr(std::is_arithmetic_v<T> || std::is_enum_v<T>)
+            {
+                static_assert(sizeof(T) == 4 || sizeof(T) == 8, "Only 32 and 64 bit scalars are supported");
+                constexpr bool wide = sizeof(T) == 8;
+
+                if constexpr(std::is_floating_point_v<T> || (Flags & flags::f))
+                {
+                    entry.kind = wide ? parse_kind::fixed64 : parse_kind::fixed32;
+                }
+                else if constexpr(Flags & flags::s)
+                {
+                    entry.kind = wide ? parse_kind::zigzag64 : parse_kind::zigzag32;
+                }
+                else
+                {
+                    entry.kind = wide ? parse_kind::varint64 : parse_kind::varint32;
+                }
+            }
+            else if constexpr(std::is_same_v<T, std::string>)
+            {
+                entry.kind = (Flags & flags::utf8) ? parse_kind::utf8_string : parse_kind::string;
+            }
+            else if constexpr(is_bytes<T>::value)
+            {
+                entry.kind = parse_kind::custom;
+                entry.parse = &table_read_bytes<T, Flags>;
+            }
+            else if constexpr(is_specialization_of<T, std::vector>::value)
+            {
+                entry.kind = parse_kind::custom;
+                entry.parse = &table_read_repeated<typename T::value_type, Flags>;
+            }
+            else if constexpr(is_specialization_of<T, std::optional>::value)
+            {
+                entry.kind = parse_kind::custom;
+                entry.parse = &table_read_optional<typename T::value_type, Flags>;
+            }
+            else
+            {
+                entry.kind = parse_kind::message;
+                entry.table = &parse_table_of<T>;
+            }
+        }
+
+        template<class T>
+        parse_table make_parse_table()
+        {
+            const T sample {};
+            auto offset_of = [&](const auto & member)
+            {
+                return static_cast<uint32_t>(reinterpret_cast<const char *>(&member) - reinterpret_cast<const char *>(&sample));
+            };
+
+            parse_table table;
+            message_type<T>().visit_fields([&](const auto & field)
+            {
+                using Field = std::decay_t<decltype(field)>;
+                using Member = typename Field::member_type;
+
+                parse_entry entry {};
+                entry.tag = Field::tag;
+                entry.offset = offset_of(Field::get(sample));
+
+                if constexpr(is_specialization_of<Member, std::map>::value)
+                {
+                    entry.kind = parse_kind::custom;
+                    entry.parse = &table_read_map<Member, Field::key_flags, Field::value_flags>;
+                }
+                else if constexpr(is_specialization_of<Member, std::variant>::value)
+                {
+                    entry.kind = parse_kind::custom;
+                    entry.parse = &table_read_oneof<Member, Field::index, Field::flags>;
+                }
+                else
+                {
+                    set_parse_kind<Member, Field::flags>(entry);
+                }
+
+                table.entries.push_back(entry);
+            });
+
+            std::stable_sort(table.entries.begin(), table.entries.end(), [](const parse_entry & a, const parse_entry & b)
+            {
+                return a.tag < b.tag;
+            });
+
+            if (!table.entries.empty())
+            {
+                uint32_t max_tag = table.entries.back().tag;
+                if (max_tag < table.entries.size() * 4 + 16 && table.entries.size() < UINT16_MAX)
+                {
+                    table.index.assign(max_tag + 1, 0);
+                    for (size_t i = table.entries.size(); i > 0; --i)
+                    {
+                        table.index[table.entries[i - 1].tag] = static_cast<uint16_t>(i);
+                    }
+                }
+            }
+
+            return table;
+        }
+
+        template<class T>
+        const parse_table &parse_table_of()
+        {
+            static const parse_table table = make_parse_table<T>();
+            return table;
+        }
+
+        bool table_read_field(char *field, const parse_entry &entry, WireType wire_type, reader &in)
+        {
+            switch (entry.kind)
+            {
+            case parse_kind::varint32:
+            {
+                uint32_t value;
+                if (wire_type != WireType::Varint || !read_varint(value, in)) return false;
+                std::memcpy(field, &value, sizeof(value));
+                return true;
+            }
+            case parse_kind::varint64:
+            {
+                uint64_t value;
+                if (wire_type != WireType::Varint || !read_varint(value, in)) return false;
+                std::memcpy(field, &value, sizeof(value));
+                return true;
+            }
+            case parse_kind::zigzag32:
+            {
+                int32_t value;
+                if (wire_type != WireType::Varint || !read_signed_varint(value, in)) return false;
+                std::memcpy(field, &value, sizeof(value));
+                return true;
+            }
+            case parse_kind::zigzag64:
+            {
+                int64_t value;
+                if (wire_type != WireType::Varint || !read_signed_varint(value, in)) return false;
+                std::memcpy(field, &value, sizeof(value));
+                return true;
+            }
+            case parse_kind::fixed32:
+            {
+                uint32_t value;
+                if (wire_type != WireType::Fixed32 || !read_fixed(value, in)) return false;
+                std::memcpy(field, &value, sizeof(value));
+                return true;
+            }
+            case parse_kind::fixed64:
+            {
+                uint64_t value;
+                if (wire_type != WireType::Fixed64 || !read_fixed(value, in)) return false;
+                std::memcpy(field, &value, sizeof(value));
+                return true;
+            }
+            case parse_kind::boolean:
+            {
+                uint32_t value;
+                if (wire_type != WireType::Varint || !read_varint(value, in)) return false;
+                *reinterpret_cast<bool *>(field) = value != 0;
+                return true;
+            }
+            case parse_kind::string:
+                return serializer<std::string>::parse(wire_type, *reinterpret_cast<std::string *>(field), flags_t<>(), in);
+            case parse_kind::utf8_string:
+                return serializer<std::string>::parse(wire_type, *reinterpret_cast<std::string *>(field), flags_t<flags::utf8>(), in);
+            case parse_kind::message:
+                return table_read_sub_message(field, entry.table(), wire_type, in);
+            case parse_kind::custom:
+                return entry.parse(field, wire_type, in);
+            }
+
+            return false;
+        }
+
+        bool table_read_message(void *value, const parse_table &table, reader &in)
+        {
+            uint32_t tag_key;
+            while (read_varint(tag_key, in))
+            {
+                uint32_t tag;
+                WireType wire_type;
+                read_tag_wire_type(tag_key, tag, wire_type);
+
+                const parse_entry *entry = table.find(tag);
+                if (!entry)
+                {
+                    if (!skip_field(wire_type, in)) return false;
+                    continue;
+                }
+
+                if (!table_read_field(static_cast<char *>(value) + entry->offset, *entry, wire_type, in)) return false;
+            }
+
+            return true;
+        }
+    }
+
+    // Same result as parse_from_reader/parse_from_string, except that unknown fields are skipped
+    // and malformed fields make the parse fail
+    template <class T>
+    bool table_parse_from_reader(T &value, reader &in)
+    {
+        return detail::table_read_message(&value, detail::parse_table_of<T>(), in);
+    }
+
+    template <class T>
+    bool table_parse_from_reader(T &value, reader &in, const parse_limits &limits)
+    {
+        detail::parse_budget budget(limits);
+
+        // Only carries the budget, a reader of unknown size stays one
+        detail::limited_reader bounded_in(in, in.available_bytes());
+        bounded_in.budget = &budget;
+
+        return detail::table_read_message(&value, detail::parse_table_of<T>(), bounded_in);
+    }
+
+    template <class T>
+    bool table_parse_from_string(T &value, const std::string &in)
+    {
+        string_reader string_in(in);
+        return table_parse_from_reader(value, string_in);
+    }
+
+    template <class T>
+    bool table_parse_from_string(T &value, const std::string &in, const parse_limits &limits)
+    {
+        string_reader string_in(in);
+        return table_parse_from_reader(value, string_in, limits);
+    }
+}
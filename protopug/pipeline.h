@@ -0,0 +1,348 @@
+#pragma once
+
+// Parallel decoding of delimited message streams (see serialize_delimited_to_writer). The calling
+// thread splits the input into batches of records by their size prefixes, a pool of workers
+// decodes the batches and hands the messages to the consumer. Only a bounded number of batches is
+// in flight at any time, so memory use doesn't depend on the size of the input.
+
+#include "protopug.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <thread>
+
+namespace protopug
+{
+    struct decode_pipeline_options
+    {
+        // 0 means one per hardware thread
+        size_t threads = 0;
+        // Records are gathered into batches of about this many bytes
+        size_t batch_size = 1024 * 1024;
+        // Batches read but not yet delivered, 0 means two per worker
+        size_t max_batches_in_flight = 0;
+        // Deliver messages in stream order, otherwise batches are delivered as they finish
+        bool ordered = true;
+    };
+
+    namespace detail
+    {
+        struct record_batch
+        {
+            size_t index;
+            std::string data;
+            // End offset of every record in data
+            std::vector<size_t> ends;
+        };
+
+        template<class T, class Consumer>
+        class decode_pipeline
+        {
+        public:
+            decode_pipeline(Consumer &consumer, const decode_pipeline_options &options)
+                : _consumer(consumer)
+                , _options(options)
+                , _queues(options.threads != 0 ? options.threads : std::max<size_t>(1, std::thread::hardware_concurrency()))
+            {
+                _max_in_flight = _options.max_batches_in_flight != 0 ? _options.max_batches_in_flight : 2 * _queues.size();
+            }
+
+            bool run(reader &in)
+            {
+                std::vector<std::thread> workers;
+                bool input_ok = false;
+                try
+                {
+                    for (size_t i = 0; i < _queues.size(); ++i)
+                    {
+                        workers.emplace_back([this, i]
+                        {
+                            try
+                            {
+                                work(i);
+                            }
+                            catch (...)
+                            {
+                                abort(std::current_exception());
+                            }
+                        });
+                    }
+
+                    input_ok = split(in);
+                }
+                catch (...)
+                {
+                    abort(std::current_exception());
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _input_done = true;
+                }
+                _work_ready.notify_all();
+
+                for (auto &worker : workers)
+                {
+                    worker.join();
+                }
+
+                if (_error) std::rethrow_exception(_error);
+
+                return input_ok && !_failed;
+            }
+
+        private:
+            struct worker_queue
+            {
+                std::mutex mutex;
+                std::deque<record_batch> batches;
+            };
+
+            // Runs on the calling thread
+            bool split(reader &in)
+            {
+                std::string record;
+
+                size_t index = 0;
+                bool end = false;
+                while (!end && !_failed)
+                {
+                    record_batch batch {index, {}, {}};
+                    batch.data.reserve(_options.batch_size);
+
+                    while (batch.data.size() < _options.batch_size)
+                    {
+                        uint64_t size;
+                        if (!read_size_prefix(size, end, in))
+                        {
+                            if (!end) return false;
+                            break;
+                        }
+
+                        if (size > in.available_bytes()) return false;
+
+                        if (in.available_bytes() != SIZE_MAX)
+                        {
+                            size_t offset = batch.data.size();
+                            batch.data.resize(offset + size);
+                            if (in.read(&batch.data[offset], size) != size) return false;
+                        }
+                        else
+                        {
+                            if (!read_string(record, size, in)) return false;
+                            batch.data += record;
+                        }
+
+                        batch.ends.push_back(batch.data.size());
+                    }
+
+                    if (batch.ends.empty()) break;
+
+                    {
+                        std::unique_lock<std::mutex> lock(_mutex);
+                        _space_ready.wait(lock, [&]
+                        {
+                            return _in_flight < _max_in_flight || _failed;
+                        });
+                        if (_failed) break;
+
+                        ++_in_flight;
+                    }
+
+                    auto &queue = _queues[index % _queues.size()];
+                    {
+                        std::lock_guard<std::mutex> lock(queue.mutex);
+                        queue.batches.push_back(std::move(batch));
+                    }
+
+                    {
+                        std::lock_guard<std::mutex> lock(_mutex);
+                        ++_queued;
+                    }
+                    _work_ready.notify_one();
+
+                    ++index;
+                }
+
+                return true;
+            }
+
+            void work(size_t self)
+            {
+                while (true)
+                {
+                    {
+                        std::unique_lock<std::mutex> lock(_mutex);
+                        _work_ready.wait(lock, [&]
+                        {
+                            return _queued > 0 || _input_done;
+                        });
+                        if (_queued == 0) return;
+
+                        --_queued;
+                    }
+
+                    // One batch is reserved for this worker, take it from the own queue or steal the
+                    // newest one of another worker
+                    record_batch batch;
+                    for (size_t i = 0;; ++i)
+                    {
+                        auto &queue = _queues[(self + i) % _queues.size()];
+                        std::lock_guard<std::mutex> lock(queue.mutex);
+                        if (queue.batches.empty()) continue;
+
+                        if (i % _queues.size() == 0)
+                        {
+                            batch = std::move(queue.batches.front());
+                            queue.batches.pop_front();
+                        }
+                        else
+                        {
+                            batch = std::move(queue.batches.back());
+                            queue.batches.pop_back();
+                        }
+                        break;
+                    }
+
+                    std::vector<T> values;
+                    if (batch.index < _stop_index && !decode(batch, values))
+                    {
+                        _failed = true;
+                        // In order the messages before the bad record are still delivered
+                        stop_before(_options.ordered ? batch.index + 1 : 0);
+                    }
+
+                    deliver(batch.index, std::move(values));
+                }
+            }
+
+            // On failure values holds the messages before the bad record
+            static bool decode(const record_batch &batch, std::vector<T> &values)
+            {
+                values.resize(batch.ends.size());
+
+                size_t begin = 0;
+                for (size_t i = 0; i < batch.ends.size(); ++i)
+                {
+                    buffer_reader buffer_in(batch.data.data() + begin, batch.ends[i] - begin);
+                    if (!read_message(values[i], message_type<T>(), buffer_in))
+                    {
+                        values.resize(i);
+                        return false;
+                    }
+
+                    begin = batch.ends[i];
+                }
+
+                return true;
+            }
+
+            // Batches from index on are not delivered anymore
+            void stop_before(size_t index)
+            {
+                size_t stop = _stop_index;
+                while (index < stop && !_stop_index.compare_exchange_weak(stop, index)) {}
+            }
+
+            // Stops the pipeline after an exception, run() rethrows it once the workers are joined
+            void abort(std::exception_ptr error)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    if (!_error) _error = error;
+                    _failed = true;
+                }
+
+                stop_before(0);
+                _space_ready.notify_all();
+            }
+
+            void deliver(size_t index, std::vector<T> values)
+            {
+                size_t delivered = 0;
+                {
+                    std::lock_guard<std::mutex> lock(_delivery_mutex);
+
+                    if (!_options.ordered || index >= _stop_index)
+                    {
+                        consume(index, values);
+                        delivered = 1;
+                    }
+                    else
+                    {
+                        _pending.emplace(index, std::move(values));
+                        while (!_pending.empty() && _pending.begin()->first == _next_index)
+                        {
+                            consume(_next_index, _pending.begin()->second);
+                            _pending.erase(_pending.begin());
+                            ++_next_index;
+                            ++delivered;
+                        }
+                    }
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _in_flight -= delivered;
+                }
+                _space_ready.notify_one();
+            }
+
+            void consume(size_t index, std::vector<T> &values)
+            {
+                if (index >= _stop_index) return;
+
+                try
+                {
+                    for (auto &value : values)
+                    {
+                        _consumer(value);
+                    }
+                }
+                catch (...)
+                {
+                    // Stopped while the delivery lock is still held, nothing is consumed after the throw
+                    stop_before(0);
+                    throw;
+                }
+            }
+
+            Consumer &_consumer;
+            decode_pipeline_options _options;
+            size_t _max_in_flight;
+            std::vector<worker_queue> _queues;
+
+            std::mutex _mutex;
+            std::condition_variable _work_ready;
+            std::condition_variable _space_ready;
+            size_t _in_flight = 0;
+            size_t _queued = 0;
+            bool _input_done = false;
+            std::atomic<bool> _failed {false};
+            // First batch index that is not delivered
+            std::atomic<size_t> _stop_index {SIZE_MAX};
+            std::exception_ptr _error;
+
+            std::mutex _delivery_mutex;
+            std::map<size_t, std::vector<T>> _pending;
+            size_t _next_index = 0;
+        };
+    }
+
+    // Decodes every message of a delimited stream and calls consumer(T &) with it. The consumer is
+    // never called concurrently, but not necessarily on the calling thread. Returns false when the
+    // stream is truncated or a record doesn't parse; in order every message before the first bad
+    // record is delivered, otherwise delivery stops at it. An exception thrown by the consumer stops
+    // the pipeline and is rethrown here once the workers are joined.
+    template<class T, class Consumer>
+    bool parse_delimited_parallel(reader &in, Consumer &&consumer, const decode_pipeline_options &options = {})
+    {
+        detail::decode_pipeline<T, std::remove_reference_t<Consumer>> pipeline(consumer, options);
+        return pipeline.run(in);
+    }
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <array>
 #include <cstring>
 #include <vector>
 #include <optional>
@@ -9,6 +10,27 @@
 #include <tuple>
 #include <cstdint>
 #include <string>
+#include <algorithm>
+#if __cplusplus >= 202002L
+#include <span>
+#endif
+
+#if defined(__BMI2__) || (defined(__x86_64__) && defined(__GNUC__))
+#include <immintrin.h>
+#endif
+
+#if defined(PROTOPUG_WITH_FIELD_STATS)
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <typeinfo>
+#if defined(__GNUG__)
+#include <cxxabi.h>
+#endif
+#endif
 
 namespace protopug
 {
@@ -24,6 +46,17 @@ namespace protopug
             using member_type = U;
         };
 
+        template<class... Alternatives>
+        struct oneof_group_impl;
+
+        template<class Field>
+        struct is_oneof_group : public std::false_type
+        {};
+
+        template<class... Alternatives>
+        struct is_oneof_group<oneof_group_impl<Alternatives...>> : public std::true_type
+        {};
+
         template<class... Fields>
         struct message_impl
         {
@@ -39,6 +72,29 @@ namespace protopug
                 visit_impl(std::forward<Handler>(handler), std::make_index_sequence<sizeof...(Fields)>());
             }
 
+            // Like visit, but oneof groups are passed as their separate oneof fields
+            template<class Handler>
+            void visit_fields(Handler &&handler) const
+            {
+                visit([&](const auto & field)
+                {
+                    if constexpr(is_oneof_group<std::decay_t<decltype(field)>>::value)
+                    {
+                        field.visit(handler);
+                    }
+                    else
+                    {
+                        handler(field);
+                    }
+                });
+            }
+
+            template<size_t I>
+            const auto &get() const
+            {
+                return std::get<I>(_fields);
+            }
+
         private:
             std::tuple<Fields...> _fields;
 
@@ -94,6 +150,40 @@ namespace protopug
             }
         };
 
+        // oneof fields of one std::variant member handled together: writing dispatches once on index(),
+        // reading goes straight to the alternative of the tag
+        template<class... Alternatives>
+        struct oneof_group_impl
+        {
+            using first = std::tuple_element_t<0, std::tuple<Alternatives...>>;
+            using type = typename first::type;
+            using member_type = typename first::member_type;
+
+            static_assert((std::is_same_v<typename Alternatives::member_type, member_type> && ...), "Alternatives of a group share one member");
+
+            const std::string field_name;
+            const std::tuple<Alternatives...> alternatives;
+
+            static decltype(auto) get(const type &value)
+            {
+                return first::get(value);
+            }
+
+            static decltype(auto) get(type &value)
+            {
+                return first::get(value);
+            }
+
+            template<class Handler>
+            void visit(Handler &&handler) const
+            {
+                std::apply([&](const auto &... alternative)
+                {
+                    (handler(alternative), ...);
+                }, alternatives);
+            }
+        };
+
         template<uint32_t Tag, class MemPtrT, MemPtrT MemPtr, uint32_t KeyFlags, uint32_t ValueFlags>
         struct map_field_impl
         {
@@ -150,7 +240,9 @@ namespace protopug
         {
             no = 0,
             s = 1,
-            f = 2
+            f = 2,
+            // string fields that have to be valid UTF-8, plain std::string fields take any bytes
+            utf8 = 4
         };
     }
 
@@ -186,6 +278,14 @@ namespace protopug
         return detail::oneof_field_impl<Tag, Index, decltype(MemPtr), MemPtr, Flags> {field_name};
     }
 
+    // Groups the oneof_fields of one std::variant member, e.g.
+    //   oneof_group("v", oneof_field<4, 0, &Message::v>("v_32"), oneof_field<5, 1, &Message::v>("v_64"))
+    template<class... Alternatives>
+    auto oneof_group(const std::string &field_name, Alternatives &&...alternatives)
+    {
+        return detail::oneof_group_impl<std::decay_t<Alternatives>...> {field_name, {std::forward<Alternatives>(alternatives)...}};
+    }
+
     template<uint32_t Tag, auto MemPtr, uint32_t KeyFlags = flags::no, uint32_t ValueFlags = flags::no>
     constexpr auto map_field(const std::string &field_name)
     {
@@ -205,11 +305,145 @@ namespace protopug
     struct writer
     {
         virtual void write(const void *bytes, size_t size) = 0;
+
+        // Set on writers that only add up the sizes written to them, bytes may be null then
+        bool size_only = false;
     };
 
+    // Resource limits for parsing untrusted input
+    struct parse_limits
+    {
+        size_t max_depth = 100;
+        // Bytes allocated by strings and by elements of repeated and map fields, in total
+        size_t max_allocation = SIZE_MAX;
+        size_t max_string_size = SIZE_MAX;
+        // Elements in a single repeated or map field
+        size_t max_repeated_size = SIZE_MAX;
+    };
+
+    namespace detail
+    {
+        struct parse_budget
+        {
+            explicit parse_budget(const parse_limits &limits)
+                : limits(limits)
+                , allocation_left(limits.max_allocation)
+            {}
+
+            bool allocate(size_t size)
+            {
+                if (size > allocation_left)
+                {
+                    exceeded = true;
+                    return false;
+                }
+
+                allocation_left -= size;
+                return true;
+            }
+
+            bool allocate_string(size_t size)
+            {
+                if (size > limits.max_string_size)
+                {
+                    exceeded = true;
+                    return false;
+                }
+
+                return allocate(size);
+            }
+
+            // A repeated or map field that grew from old_size to size elements
+            bool allocate_elements(size_t old_size, size_t size, size_t element_size)
+            {
+                if (size > limits.max_repeated_size)
+                {
+                    exceeded = true;
+                    return false;
+                }
+
+                return allocate((size - old_size) * element_size);
+            }
+
+            bool enter()
+            {
+                if (depth >= limits.max_depth)
+                {
+                    exceeded = true;
+                    return false;
+                }
+
+                ++depth;
+                return true;
+            }
+
+            void leave()
+            {
+                --depth;
+            }
+
+            const parse_limits &limits;
+            size_t allocation_left;
+            size_t depth = 0;
+            bool exceeded = false;
+        };
+    }
+
+    namespace detail
+    {
+        bool is_valid_utf8(const uint8_t *data, size_t size);
+    }
+
     struct reader
     {
         virtual size_t read(void *bytes, size_t size) = 0;
+
+        // Reads size bytes and checks that they are valid UTF-8. Readers over contiguous memory
+        // validate while copying.
+        virtual bool read_utf8(void *bytes, size_t size)
+        {
+            return read(bytes, size) == size && detail::is_valid_utf8(static_cast<const uint8_t *>(bytes), size);
+        }
+
+        // Reads a varint of at most max_size bytes, returns the number of bytes it took or 0 when it
+        // is malformed. Readers over contiguous memory decode it in place.
+        virtual size_t decode_varint(uint64_t &value, size_t max_size)
+        {
+            value = 0;
+            for (size_t i = 0; i < max_size; ++i)
+            {
+                uint8_t byte;
+                if (read(&byte, 1) != 1) return 0;
+
+                value |= static_cast<uint64_t>(byte & 0b0111'1111) << 7 * i;
+                if (!(byte & 0b1000'0000)) return i + 1;
+            }
+
+            return 0;
+        }
+
+        // Upper bound of the bytes left, length prefixes beyond it are rejected before allocating
+        virtual size_t available_bytes() const
+        {
+            return SIZE_MAX;
+        }
+
+        // True when available_bytes() is backed by input that is really there, so that a length
+        // prefix up to it can be allocated before its bytes are read
+        virtual bool size_known() const
+        {
+            return available_bytes() != SIZE_MAX;
+        }
+
+        // The next size bytes without consuming them. Only readers over contiguous memory have them,
+        // the others return nullptr.
+        virtual const uint8_t *peek(size_t /*size*/)
+        {
+            return nullptr;
+        }
+
+        // Set while parsing with parse_limits, nested readers inherit it
+        detail::parse_budget *budget = nullptr;
     };
 
     namespace detail
@@ -226,6 +460,85 @@ namespace protopug
         template<class T, class V, class F, class W>
         constexpr bool has_serialize_packed_v = has_serialize_packed<T, V, F, W>::value;
 
+        template<class T, template<class...> class Template>
+        struct is_specialization_of : public std::false_type
+        {};
+
+        template<template<class...> class Template, class... Args>
+        struct is_specialization_of<Template<Args...>, Template> : public std::true_type
+        {};
+
+        // Members encoded as one length-delimited payload of raw bytes instead of a sub-message
+        template<class T>
+        struct is_bytes : public std::is_same<T, std::string>
+        {};
+
+        // Field descriptor with the given tag in a message_impl, void if there is none
+        template<uint32_t Tag, class... Fields>
+        struct field_with_tag
+        {
+            using type = void;
+        };
+
+        template<uint32_t Tag, class Field, class... Rest>
+        struct field_with_tag<Tag, Field, Rest...>
+        {
+            using type = std::conditional_t<Field::tag == Tag, Field, typename field_with_tag<Tag, Rest...>::type>;
+        };
+
+        template<class Field>
+        struct field_alternatives
+        {
+            using type = std::tuple<Field>;
+        };
+
+        template<class... Alternatives>
+        struct field_alternatives<oneof_group_impl<Alternatives...>>
+        {
+            using type = std::tuple<Alternatives...>;
+        };
+
+        template<class Tuple>
+        struct message_of_tuple;
+
+        template<class... Fields>
+        struct message_of_tuple<std::tuple<Fields...>>
+        {
+            using type = message_impl<Fields...>;
+        };
+
+        // The message with oneof groups replaced by their oneof fields
+        template<class Message>
+        struct flat_message;
+
+        template<class... Fields>
+        struct flat_message<message_impl<Fields...>>
+        {
+            using type = typename message_of_tuple<decltype(std::tuple_cat(std::declval<typename field_alternatives<Fields>::type>()...))>::type;
+        };
+
+        template<class Message>
+        using flat_message_t = typename flat_message<Message>::type;
+
+        template<uint32_t Tag, class Message>
+        struct flat_field_with_tag;
+
+        template<uint32_t Tag, class... Fields>
+        struct flat_field_with_tag<Tag, message_impl<Fields...>> : public field_with_tag<Tag, Fields...>
+        {};
+
+        // Alternatives of oneof groups are found by their own tags
+        template<uint32_t Tag, class Message>
+        struct message_field_with_tag : public flat_field_with_tag<Tag, flat_message_t<Message>>
+        {};
+
+        template<class Message>
+        struct message_field_count;
+
+        template<class... Fields>
+        struct message_field_count<message_impl<Fields...>> : public std::integral_constant<size_t, sizeof...(Fields)>
+        {};
+
         template<class T, class V, class F, class R, class Enable = void>
         struct has_parse_packed : public std::false_type
         {};
@@ -283,6 +596,11 @@ namespace protopug
 
         struct writer_size_collector : public writer
         {
+            writer_size_collector()
+            {
+                size_only = true;
+            }
+
             void write(const void */*bytes*/, size_t size) override
             {
                 byte_size += size;
@@ -295,9 +613,11 @@ namespace protopug
             limited_reader(reader &parent, size_t size_limit)
                 : _parent(parent)
                 , _size_limit(size_limit)
-            {}
+            {
+                budget = parent.budget;
+            }
 
-            size_t read(void *bytes, size_t size)
+            size_t read(void *bytes, size_t size) override
             {
                 auto size_to_read = std::min(size, _size_limit);
                 auto read_size = _parent.read(bytes, size_to_read);
@@ -305,11 +625,40 @@ namespace protopug
                 return read_size;
             }
 
-            size_t available_bytes() const
+            size_t available_bytes() const override
             {
                 return _size_limit;
             }
 
+            // The limit is a length prefix, it is only backed by input when the parent's size is
+            bool size_known() const override
+            {
+                return _parent.size_known();
+            }
+
+            size_t decode_varint(uint64_t &value, size_t max_size) override
+            {
+                // Close to the limit the varint could run past it
+                if (_size_limit < max_size) return reader::decode_varint(value, max_size);
+
+                size_t size = _parent.decode_varint(value, max_size);
+                _size_limit -= size;
+                return size;
+            }
+
+            bool read_utf8(void *bytes, size_t size) override
+            {
+                if (_size_limit < size) return reader::read_utf8(bytes, size);
+
+                _size_limit -= size;
+                return _parent.read_utf8(bytes, size);
+            }
+
+            const uint8_t *peek(size_t size) override
+            {
+                return size <= _size_limit ? _parent.peek(size) : nullptr;
+            }
+
         private:
             reader &_parent;
             size_t _size_limit;
@@ -365,40 +714,17 @@ namespace protopug
 
         bool read_varint(uint32_t &value, reader &in)
         {
-            value = 0;
-            for (size_t c = 0; c < 5 /*(32 / 7) + 1*/; ++c)
-            {
-                uint8_t x;
-                if (!read_byte(x, in))
-                    return false;
-
-                value |= static_cast<uint32_t>(x & 0b0111'1111) << 7 * c;
-                if (!(x & 0b1000'0000))
-                {
-                    return true;
-                }
-            }
+            uint64_t wide_value;
+            if (in.decode_varint(wide_value, 5 /*(32 / 7) + 1*/) == 0)
+                return false;
 
-            return false;
+            value = static_cast<uint32_t>(wide_value);
+            return true;
         }
 
         bool read_varint(uint64_t &value, reader &in)
         {
-            value &= 0;
-            for (size_t c = 0; c < 10 /*(64 / 7) + 1*/; ++c)
-            {
-                uint8_t x;
-                if (!read_byte(x, in))
-                    return false;
-
-                value |= static_cast<uint64_t>(x & 0b0111'1111) << 7 * c;
-                if (!(x & 0b1000'0000))
-                {
-                    return true;
-                }
-            }
-
-            return false;
+            return in.decode_varint(value, 10 /*(64 / 7) + 1*/) != 0;
         }
 
         void write_fixed(uint32_t value, writer &out)
@@ -570,69 +896,826 @@ namespace protopug
             return false;
         }
 
-        template<class T, uint32_t Tag, size_t Index, class MemPtrT, MemPtrT MemPtr, uint32_t Flags>
-        void write_field(const T &value, const detail::oneof_field_impl<Tag, Index, MemPtrT, MemPtr, Flags> &/*field*/, writer &out)
+        bool skip_bytes(size_t size, reader &in)
         {
-            using OneOf = detail::oneof_field_impl<Tag, Index, MemPtrT, MemPtr, Flags>;
-            serializer<typename OneOf::member_type>::template serialize_oneof<OneOf::index>(OneOf::tag, OneOf::get(value), flags_t<OneOf::flags>(),
-                    out);
-        }
+            uint8_t buffer[256];
+            while (size > 0)
+            {
+                size_t chunk = std::min(size, sizeof(buffer));
+                if (in.read(buffer, chunk) != chunk)
+                    return false;
 
-        template<class T, uint32_t Tag, class MemPtrT, MemPtrT MemPtr, uint32_t KeyFlags, uint32_t ValueFlags>
-        void write_field(const T &value, const detail::map_field_impl<Tag, MemPtrT, MemPtr, KeyFlags, ValueFlags> &/*field*/, writer &out)
-        {
-            using Map = detail::map_field_impl<Tag, MemPtrT, MemPtr, KeyFlags, ValueFlags>;
-            serializer<typename Map::member_type>::serialize_map(Map::tag, Map::get(value), flags_t<Map::key_flags>(), flags_t<Map::value_flags>(),
-                    out);
+                size -= chunk;
+            }
+            return true;
         }
 
-        template<class T, uint32_t Tag, class MemPtrT, MemPtrT MemPtr, uint32_t Flags>
-        void write_field(const T &value, const detail::field_impl<Tag, MemPtrT, MemPtr, Flags> &/*field*/, writer &out)
+        // Reads size bytes into value. Without a known end of input the length prefix can't be trusted,
+        // so the string then grows with the data actually read instead of being sized up front.
+        bool read_string(std::string &value, size_t size, reader &in)
         {
-            using Field = detail::field_impl<Tag, MemPtrT, MemPtr, Flags>;
-            serializer<typename Field::member_type>::serialize(Field::tag, Field::get(value), flags_t<Field::flags>(), out);
-        }
+            if (in.size_known())
+            {
+                value.resize(size);
+                return in.read(value.data(), size) == size;
+            }
 
-        template<class T, class... Field>
-        void write_message(const T &value, const detail::message_impl<Field...> &message, writer &out)
-        {
-            message.visit([&](const auto & field)
+            constexpr size_t min_chunk_size = 64 * 1024;
+
+            value.clear();
+            while (value.size() < size)
             {
-                write_field(value, field, out);
-            });
+                size_t offset = value.size();
+                size_t chunk_size = std::min(size - offset, std::max(offset, min_chunk_size));
+                value.resize(offset + chunk_size);
+                if (in.read(value.data() + offset, chunk_size) != chunk_size) return false;
+            }
+
+            return true;
         }
 
-        template<uint32_t Flags, class ValueType, class It>
-        void write_repeated(uint32_t Tag, It begin, It end, writer &out)
+        // Reads the size prefix of a delimited message. end is set when the stream ended before it
+        bool read_size_prefix(uint64_t &size, bool &end, reader &in)
         {
-            if (begin == end) return;
+            uint8_t byte;
+            end = !read_byte(byte, in);
+            if (end) return false;
 
-            if constexpr(detail::has_serialize_packed_v<serializer<ValueType>, ValueType, flags_t<Flags>, writer>)
+            size = byte & 0b0111'1111;
+            for (size_t shift = 7; byte & 0b1000'0000; shift += 7)
             {
-                write_varint(make_tag_wire_type(Tag, WireType::LengthDelimeted), out);
-
-                writer_size_collector size_collector;
-                for (auto it = begin; it != end; ++it)
-                {
-                    serializer<ValueType>::serialize_packed(*it, flags_t<Flags> {}, size_collector);
-                }
+                if (shift >= 64 || !read_byte(byte, in)) return false;
+                size |= static_cast<uint64_t>(byte & 0b0111'1111) << shift;
+            }
 
-                write_varint(size_collector.byte_size, out);
+            return true;
+        }
 
-                for (auto it = begin; it != end; ++it)
-                {
-                    serializer<ValueType>::serialize_packed(*it, flags_t<Flags> {}, out);
-                }
+        bool skip_field(WireType wire_type, reader &in)
+        {
+            switch (wire_type)
+            {
+            case WireType::Varint:
+            {
+                uint64_t value;
+                return read_varint(value, in);
             }
-            else
+            case WireType::Fixed64:
+                return skip_bytes(8, in);
+            case WireType::Fixed32:
+                return skip_bytes(4, in);
+            case WireType::LengthDelimeted:
             {
-                for (auto it = begin; it != end; ++it)
+                size_t size;
+                return read_varint(size, in) && skip_bytes(size, in);
+            }
+            default:
+                // Groups are not supported
+                return false;
+            }
+        }
+
+        size_t varint_size(uint64_t value)
+        {
+            size_t size = 1;
+            while (value >>= 7)
+            {
+                ++size;
+            }
+            return size;
+        }
+
+        // Joins the 7 bit groups of a little-endian word whose bytes above the last one of the varint are cleared
+        uint64_t compact_varint(uint64_t word)
+        {
+#if defined(__BMI2__)
+            return _pext_u64(word, UINT64_C(0x7f7f7f7f7f7f7f7f));
+#else
+            word = (word & UINT64_C(0x007f007f007f007f)) | ((word & UINT64_C(0x7f007f007f007f00)) >> 1);
+            word = (word & UINT64_C(0x00003fff00003fff)) | ((word & UINT64_C(0x3fff00003fff0000)) >> 2);
+            return (word & UINT64_C(0x000000000fffffff)) | ((word & UINT64_C(0x0fffffff00000000)) >> 4);
+#endif
+        }
+
+        constexpr size_t varint_slack = 10;
+
+        // Decodes a varint of at most max_size bytes from one 8 byte load: the terminating byte is
+        // found with a bit scan over the continuation bits instead of a branch per byte. Needs
+        // varint_slack readable bytes at pos; returns the size of the varint or 0 if it is malformed.
+        size_t decode_varint_unchecked(uint64_t &value, const uint8_t *pos, size_t max_size)
+        {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            uint64_t word;
+            std::memcpy(&word, pos, sizeof(word));
+
+            uint64_t stops = ~word & UINT64_C(0x8080808080808080);
+            if (stops)
+            {
+                size_t bits = __builtin_ctzll(stops) + 1;
+                size_t size = bits / 8;
+                if (size > max_size) return 0;
+
+                value = compact_varint(bits == 64 ? word : word & ((UINT64_C(1) << bits) - 1));
+                return size;
+            }
+
+            if (max_size < 9) return 0;
+
+            value = compact_varint(word) | static_cast<uint64_t>(pos[8] & 0b0111'1111) << 56;
+            if (!(pos[8] & 0b1000'0000)) return 9;
+
+            if (max_size < 10 || (pos[9] & 0b1000'0000)) return 0;
+
+            value |= static_cast<uint64_t>(pos[9]) << 63;
+            return 10;
+#else
+            static_assert(false, "Not a little-endian");
+#endif
+        }
+
+        bool read_varint(uint64_t &value, const uint8_t *&pos, const uint8_t *end)
+        {
+            if (static_cast<size_t>(end - pos) >= varint_slack)
+            {
+                size_t size = decode_varint_unchecked(value, pos, 10);
+                pos += size;
+                return size != 0;
+            }
+
+            value = 0;
+            for (size_t c = 0; c < 10 /*(64 / 7) + 1*/ && pos != end; ++c)
+            {
+                uint8_t x = *pos++;
+
+                value |= static_cast<uint64_t>(x & 0b0111'1111) << 7 * c;
+                if (!(x & 0b1000'0000))
+                {
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        // One decoded tag/value pair of a contiguous buffer. Length delimited payloads are not copied,
+        // data/size point into the buffer.
+        struct wire_record
+        {
+            uint32_t tag = 0;
+            WireType wire_type = WireType::Varint;
+            uint64_t value = 0;
+            const uint8_t *data = nullptr;
+            size_t size = 0;
+        };
+
+        bool is_valid_utf8_scalar(const uint8_t *data, size_t size)
+        {
+            auto end = data + size;
+            while (data != end)
+            {
+                // ASCII runs are checked 8 bytes at a time
+                if (end - data >= 8)
+                {
+                    uint64_t word;
+                    std::memcpy(&word, data, sizeof(word));
+                    if (!(word & UINT64_C(0x8080808080808080)))
+                    {
+                        data += 8;
+                        continue;
+                    }
+                }
+
+                uint8_t lead = *data;
+                if (lead < 0x80)
+                {
+                    ++data;
+                    continue;
+                }
+
+                size_t length;
+                uint8_t min = 0x80, max = 0xBF;
+                if (lead >= 0xC2 && lead <= 0xDF)
+                {
+                    length = 2;
+                }
+                else if (lead >= 0xE0 && lead <= 0xEF)
+                {
+                    length = 3;
+                    if (lead == 0xE0) min = 0xA0;       // overlong
+                    else if (lead == 0xED) max = 0x9F;  // surrogates
+                }
+                else if (lead >= 0xF0 && lead <= 0xF4)
+                {
+                    length = 4;
+                    if (lead == 0xF0) min = 0x90;       // overlong
+                    else if (lead == 0xF4) max = 0x8F;  // above U+10FFFF
+                }
+                else
+                {
+                    return false;
+                }
+
+                if (static_cast<size_t>(end - data) < length) return false;
+                if (data[1] < min || data[1] > max) return false;
+                for (size_t i = 2; i < length; ++i)
+                {
+                    if ((data[i] & 0xC0) != 0x80) return false;
+                }
+
+                data += length;
+            }
+
+            return true;
+        }
+
+#if defined(__x86_64__) && defined(__GNUC__)
+        // Vectorized validation after Keiser and Lemire, "Validating UTF-8 in less than one instruction
+        // per byte". Three nibble lookups classify every byte together with the one before it, the
+        // bits left set after and-ing them name the error. Continuation bytes of 3 and 4 byte
+        // sequences are checked separately against the lead byte 2 or 3 positions back.
+        namespace utf8_error
+        {
+            constexpr uint8_t too_short = 1 << 0;
+            constexpr uint8_t too_long = 1 << 1;
+            constexpr uint8_t overlong_3 = 1 << 2;
+            constexpr uint8_t too_large = 1 << 3;
+            constexpr uint8_t surrogate = 1 << 4;
+            constexpr uint8_t overlong_2 = 1 << 5;
+            constexpr uint8_t too_large_1000 = 1 << 6;
+            constexpr uint8_t overlong_4 = 1 << 6;
+            constexpr uint8_t two_conts = 1 << 7;
+            constexpr uint8_t carry = too_short | too_long | two_conts;
+        }
+
+        // Indexed by the high nibble of the previous byte
+        alignas(16) constexpr uint8_t utf8_byte_1_high[16] =
+        {
+            utf8_error::too_long, utf8_error::too_long, utf8_error::too_long, utf8_error::too_long,
+            utf8_error::too_long, utf8_error::too_long, utf8_error::too_long, utf8_error::too_long,
+            utf8_error::two_conts, utf8_error::two_conts, utf8_error::two_conts, utf8_error::two_conts,
+            utf8_error::too_short | utf8_error::overlong_2,
+            utf8_error::too_short,
+            utf8_error::too_short | utf8_error::overlong_3 | utf8_error::surrogate,
+            utf8_error::too_short | utf8_error::too_large | utf8_error::too_large_1000 | utf8_error::overlong_4
+        };
+
+        // Indexed by the low nibble of the previous byte
+        alignas(16) constexpr uint8_t utf8_byte_1_low[16] =
+        {
+            utf8_error::carry | utf8_error::overlong_3 | utf8_error::overlong_2 | utf8_error::overlong_4,
+            utf8_error::carry | utf8_error::overlong_2,
+            utf8_error::carry,
+            utf8_error::carry,
+            utf8_error::carry | utf8_error::too_large,
+            utf8_error::carry | utf8_error::too_large | utf8_error::too_large_1000,
+            utf8_error::carry | utf8_error::too_large | utf8_error::too_large_1000,
+            utf8_error::carry | utf8_error::too_large | utf8_error::too_large_1000,
+            utf8_error::carry | utf8_error::too_large | utf8_error::too_large_1000,
+            utf8_error::carry | utf8_error::too_large | utf8_error::too_large_1000,
+            utf8_error::carry | utf8_error::too_large | utf8_error::too_large_1000,
+            utf8_error::carry | utf8_error::too_large | utf8_error::too_large_1000,
+            utf8_error::carry | utf8_error::too_large | utf8_error::too_large_1000,
+            utf8_error::carry | utf8_error::too_large | utf8_error::too_large_1000 | utf8_error::surrogate,
+            utf8_error::carry | utf8_error::too_large | utf8_error::too_large_1000,
+            utf8_error::carry | utf8_error::too_large | utf8_error::too_large_1000
+        };
+
+        // Indexed by the high nibble of the current byte
+        alignas(16) constexpr uint8_t utf8_byte_2_high[16] =
+        {
+            utf8_error::too_short, utf8_error::too_short, utf8_error::too_short, utf8_error::too_short,
+            utf8_error::too_short, utf8_error::too_short, utf8_error::too_short, utf8_error::too_short,
+            utf8_error::too_long | utf8_error::overlong_2 | utf8_error::two_conts | utf8_error::overlong_3 | utf8_error::too_large_1000
+            | utf8_error::overlong_4,
+            utf8_error::too_long | utf8_error::overlong_2 | utf8_error::two_conts | utf8_error::overlong_3 | utf8_error::too_large,
+            utf8_error::too_long | utf8_error::overlong_2 | utf8_error::two_conts | utf8_error::surrogate | utf8_error::too_large,
+            utf8_error::too_long | utf8_error::overlong_2 | utf8_error::two_conts | utf8_error::surrogate | utf8_error::too_large,
+            utf8_error::too_short, utf8_error::too_short, utf8_error::too_short, utf8_error::too_short
+        };
+
+        // Adds the errors of one vector of input, given the vector before it
+        __attribute__((target("avx2"), always_inline)) inline void check_utf8_avx2(__m256i input, __m256i previous, __m256i &error)
+        {
+            const __m256i byte_1_high = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(utf8_byte_1_high)));
+            const __m256i byte_1_low = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(utf8_byte_1_low)));
+            const __m256i byte_2_high = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(utf8_byte_2_high)));
+            const __m256i nibble = _mm256_set1_epi8(0x0F);
+
+            __m256i shifted = _mm256_permute2x128_si256(previous, input, 0x21);
+            __m256i prev1 = _mm256_alignr_epi8(input, shifted, 15);
+            __m256i prev2 = _mm256_alignr_epi8(input, shifted, 14);
+            __m256i prev3 = _mm256_alignr_epi8(input, shifted, 13);
+
+            __m256i special = _mm256_and_si256(
+                                  _mm256_and_si256(_mm256_shuffle_epi8(byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+                                          _mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, nibble))),
+                                  _mm256_shuffle_epi8(byte_2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+
+            __m256i third_byte = _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xE0 - 0x80));
+            __m256i fourth_byte = _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xF0 - 0x80));
+            __m256i must_continue = _mm256_and_si256(_mm256_or_si256(third_byte, fourth_byte), _mm256_set1_epi8(static_cast<char>(0x80)));
+
+            error = _mm256_or_si256(error, _mm256_xor_si256(must_continue, special));
+        }
+
+        // Copy is false for plain validation, dst is unused then
+        template<bool Copy>
+        __attribute__((target("avx2"))) bool validate_utf8_avx2(uint8_t *dst, const uint8_t *src, size_t size)
+        {
+            // Lead bytes in the last 3 positions need bytes from the next block
+            const __m256i incomplete_limit = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                             -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                             static_cast<char>(0xF0 - 1), static_cast<char>(0xE0 - 1), static_cast<char>(0xC0 - 1));
+
+            __m256i error = _mm256_setzero_si256();
+            __m256i previous = _mm256_setzero_si256();
+            __m256i previous_incomplete = _mm256_setzero_si256();
+
+            // ASCII is skipped 64 bytes at a time, shorter runs would make the branch unpredictable
+            alignas(32) uint8_t tail[64];
+            for (size_t i = 0; i < size; i += 64)
+            {
+                const uint8_t *block = src + i;
+                if (size - i < 64)
+                {
+                    // Zero padding is ASCII, a sequence cut off by the end shows up as too short
+                    std::memset(tail, 0, sizeof(tail));
+                    std::memcpy(tail, block, size - i);
+                    block = tail;
+                }
+
+                __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block));
+                __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block + 32));
+
+                if constexpr(Copy)
+                {
+                    if (block == tail)
+                    {
+                        std::memcpy(dst + i, tail, size - i);
+                    }
+                    else
+                    {
+                        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), low);
+                        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i + 32), high);
+                    }
+                }
+
+                if (_mm256_movemask_epi8(_mm256_or_si256(low, high)) == 0)
+                {
+                    error = _mm256_or_si256(error, previous_incomplete);
+                }
+                else
+                {
+                    check_utf8_avx2(low, previous, error);
+                    check_utf8_avx2(high, low, error);
+                    previous_incomplete = _mm256_subs_epu8(high, incomplete_limit);
+                }
+
+                previous = high;
+            }
+
+            error = _mm256_or_si256(error, previous_incomplete);
+            return _mm256_testz_si256(error, error);
+        }
+
+        __attribute__((target("sse4.1"), always_inline)) inline void check_utf8_sse41(__m128i input, __m128i previous, __m128i &error)
+        {
+            const __m128i byte_1_high = _mm_load_si128(reinterpret_cast<const __m128i *>(utf8_byte_1_high));
+            const __m128i byte_1_low = _mm_load_si128(reinterpret_cast<const __m128i *>(utf8_byte_1_low));
+            const __m128i byte_2_high = _mm_load_si128(reinterpret_cast<const __m128i *>(utf8_byte_2_high));
+            const __m128i nibble = _mm_set1_epi8(0x0F);
+
+            __m128i prev1 = _mm_alignr_epi8(input, previous, 15);
+            __m128i prev2 = _mm_alignr_epi8(input, previous, 14);
+            __m128i prev3 = _mm_alignr_epi8(input, previous, 13);
+
+            __m128i special = _mm_and_si128(
+                                  _mm_and_si128(_mm_shuffle_epi8(byte_1_high, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+                                          _mm_shuffle_epi8(byte_1_low, _mm_and_si128(prev1, nibble))),
+                                  _mm_shuffle_epi8(byte_2_high, _mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+
+            __m128i third_byte = _mm_subs_epu8(prev2, _mm_set1_epi8(0xE0 - 0x80));
+            __m128i fourth_byte = _mm_subs_epu8(prev3, _mm_set1_epi8(0xF0 - 0x80));
+            __m128i must_continue = _mm_and_si128(_mm_or_si128(third_byte, fourth_byte), _mm_set1_epi8(static_cast<char>(0x80)));
+
+            error = _mm_or_si128(error, _mm_xor_si128(must_continue, special));
+        }
+
+        template<bool Copy>
+        __attribute__((target("sse4.1"))) bool validate_utf8_sse41(uint8_t *dst, const uint8_t *src, size_t size)
+        {
+            const __m128i incomplete_limit = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                             static_cast<char>(0xF0 - 1), static_cast<char>(0xE0 - 1), static_cast<char>(0xC0 - 1));
+
+            __m128i error = _mm_setzero_si128();
+            __m128i previous = _mm_setzero_si128();
+            __m128i previous_incomplete = _mm_setzero_si128();
+
+            alignas(16) uint8_t tail[64];
+            for (size_t i = 0; i < size; i += 64)
+            {
+                const uint8_t *block = src + i;
+                if (size - i < 64)
+                {
+                    std::memset(tail, 0, sizeof(tail));
+                    std::memcpy(tail, block, size - i);
+                    block = tail;
+                }
+
+                __m128i input0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block));
+                __m128i input1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + 16));
+                __m128i input2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + 32));
+                __m128i input3 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + 48));
+
+                if constexpr(Copy)
+                {
+                    if (block == tail)
+                    {
+                        std::memcpy(dst + i, tail, size - i);
+                    }
+                    else
+                    {
+                        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), input0);
+                        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i + 16), input1);
+                        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i + 32), input2);
+                        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i + 48), input3);
+                    }
+                }
+
+                if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(input0, input1), _mm_or_si128(input2, input3))) == 0)
+                {
+                    error = _mm_or_si128(error, previous_incomplete);
+                }
+                else
+                {
+                    check_utf8_sse41(input0, previous, error);
+                    check_utf8_sse41(input1, input0, error);
+                    check_utf8_sse41(input2, input1, error);
+                    check_utf8_sse41(input3, input2, error);
+                    previous_incomplete = _mm_subs_epu8(input3, incomplete_limit);
+                }
+
+                previous = input3;
+            }
+
+            error = _mm_or_si128(error, previous_incomplete);
+            return _mm_testz_si128(error, error);
+        }
+#endif
+
+        template<bool Copy>
+        bool validate_utf8_scalar(uint8_t *dst, const uint8_t *src, size_t size)
+        {
+            if constexpr(Copy) std::memcpy(dst, src, size);
+            return is_valid_utf8_scalar(src, size);
+        }
+
+        using validate_utf8_function = bool (*)(uint8_t *dst, const uint8_t *src, size_t size);
+
+        // Picks the widest implementation the CPU supports, once
+        template<bool Copy>
+        validate_utf8_function select_validate_utf8()
+        {
+#if defined(__x86_64__) && defined(__GNUC__)
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2")) return &validate_utf8_avx2<Copy>;
+            if (__builtin_cpu_supports("sse4.1")) return &validate_utf8_sse41<Copy>;
+#endif
+            return &validate_utf8_scalar<Copy>;
+        }
+
+        bool is_valid_utf8(const uint8_t *data, size_t size)
+        {
+            // Short strings aren't worth a vector pass
+            if (size < 16) return is_valid_utf8_scalar(data, size);
+
+            static const validate_utf8_function validate = select_validate_utf8<false>();
+            return validate(nullptr, data, size);
+        }
+
+        // Copies size bytes from src to dst and checks them in the same pass
+        bool copy_utf8(uint8_t *dst, const uint8_t *src, size_t size)
+        {
+            if (size < 16) return validate_utf8_scalar<true>(dst, src, size);
+
+            static const validate_utf8_function copy = select_validate_utf8<true>();
+            return copy(dst, src, size);
+        }
+
+        bool read_record(wire_record &record, const uint8_t *&pos, const uint8_t *end)
+        {
+            uint64_t tag_key;
+            if (!read_varint(tag_key, pos, end) || tag_key > UINT32_MAX)
+                return false;
+
+            read_tag_wire_type(static_cast<uint32_t>(tag_key), record.tag, record.wire_type);
+
+            switch (record.wire_type)
+            {
+            case WireType::Varint:
+                return read_varint(record.value, pos, end);
+            case WireType::Fixed64:
+            case WireType::Fixed32:
+            {
+                size_t size = record.wire_type == WireType::Fixed64 ? 8 : 4;
+                if (static_cast<size_t>(end - pos) < size)
+                    return false;
+
+                record.value = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+                std::memcpy(&record.value, pos, size);
+#else
+                static_assert(false, "Not a little-endian");
+#endif
+                pos += size;
+                return true;
+            }
+            case WireType::LengthDelimeted:
+            {
+                uint64_t size;
+                if (!read_varint(size, pos, end) || size > static_cast<size_t>(end - pos))
+                    return false;
+
+                record.data = pos;
+                record.size = size;
+                pos += size;
+                return true;
+            }
+            default:
+                // Groups are not supported
+                return false;
+            }
+        }
+
+        template<class T, uint32_t Tag, size_t Index, class MemPtrT, MemPtrT MemPtr, uint32_t Flags>
+        void write_field(const T &value, const detail::oneof_field_impl<Tag, Index, MemPtrT, MemPtr, Flags> &/*field*/, writer &out)
+        {
+            using OneOf = detail::oneof_field_impl<Tag, Index, MemPtrT, MemPtr, Flags>;
+            serializer<typename OneOf::member_type>::template serialize_oneof<OneOf::index>(OneOf::tag, OneOf::get(value), flags_t<OneOf::flags>(),
+                    out);
+        }
+
+        template<class T, class OneOf>
+        void write_oneof_alternative(const T &value, writer &out)
+        {
+            serializer<typename OneOf::member_type>::template serialize_alternative<OneOf::index>(OneOf::tag, OneOf::get(value), flags_t<OneOf::flags>(),
+                    out);
+        }
+
+        template<class T, class... Alternatives>
+        struct oneof_group_writers
+        {
+            using write_function = void (*)(const T &value, writer &out);
+            constexpr static const size_t size = std::variant_size_v<typename oneof_group_impl<Alternatives...>::member_type>;
+
+            static constexpr std::array<write_function, size> make()
+            {
+                std::array<write_function, size> writers {};
+                ((writers[Alternatives::index] = &write_oneof_alternative<T, Alternatives>), ...);
+                return writers;
+            }
+
+            // By index() of the variant, nullptr for alternatives without a field
+            constexpr static const std::array<write_function, size> writers = make();
+        };
+
+        template<class T, class... Alternatives>
+        void write_field(const T &value, const detail::oneof_group_impl<Alternatives...> &/*group*/, writer &out)
+        {
+            using Group = oneof_group_impl<Alternatives...>;
+            using writers = oneof_group_writers<T, Alternatives...>;
+
+            size_t index = Group::get(value).index();
+            if (index < writers::size && writers::writers[index]) writers::writers[index](value, out);
+        }
+
+        template<class T, uint32_t Tag, class MemPtrT, MemPtrT MemPtr, uint32_t KeyFlags, uint32_t ValueFlags>
+        void write_field(const T &value, const detail::map_field_impl<Tag, MemPtrT, MemPtr, KeyFlags, ValueFlags> &/*field*/, writer &out)
+        {
+            using Map = detail::map_field_impl<Tag, MemPtrT, MemPtr, KeyFlags, ValueFlags>;
+            serializer<typename Map::member_type>::serialize_map(Map::tag, Map::get(value), flags_t<Map::key_flags>(), flags_t<Map::value_flags>(),
+                    out);
+        }
+
+        template<class T, uint32_t Tag, class MemPtrT, MemPtrT MemPtr, uint32_t Flags>
+        void write_field(const T &value, const detail::field_impl<Tag, MemPtrT, MemPtr, Flags> &/*field*/, writer &out)
+        {
+            using Field = detail::field_impl<Tag, MemPtrT, MemPtr, Flags>;
+            serializer<typename Field::member_type>::serialize(Field::tag, Field::get(value), flags_t<Field::flags>(), out);
+        }
+
+#if defined(PROTOPUG_WITH_FIELD_STATS)
+#if !defined(PROTOPUG_FIELD_STATS_SAMPLE_RATE)
+        // Every n-th occurrence of a field is timed, 0 turns timing off
+#define PROTOPUG_FIELD_STATS_SAMPLE_RATE 64
+#endif
+
+        struct field_counters
+        {
+            const std::type_info &message_type;
+            std::string field_name;
+            uint32_t tag;
+
+            std::atomic<uint64_t> calls {0};
+            std::atomic<uint64_t> writes {0};
+            std::atomic<uint64_t> written_bytes {0};
+            std::atomic<uint64_t> reads {0};
+            std::atomic<uint64_t> read_bytes {0};
+            std::atomic<uint64_t> samples {0};
+            std::atomic<uint64_t> sampled_nanoseconds {0};
+        };
+
+        struct field_stats_registry
+        {
+            static field_stats_registry &instance()
+            {
+                static field_stats_registry registry;
+                return registry;
+            }
+
+            std::mutex mutex;
+            std::vector<std::unique_ptr<field_counters>> counters;
+        };
+
+        template<class T, uint32_t Tag>
+        field_counters &field_counters_of(const std::string &field_name)
+        {
+            static field_counters &counters = [&]() -> field_counters &
+            {
+                auto &registry = field_stats_registry::instance();
+                std::lock_guard<std::mutex> lock(registry.mutex);
+                registry.counters.push_back(std::unique_ptr<field_counters>(new field_counters {typeid(T), field_name, Tag}));
+                return *registry.counters.back();
+            }();
+            return counters;
+        }
+
+        struct field_stats_sample
+        {
+            explicit field_stats_sample(field_counters &counters)
+                : _counters(counters)
+            {
+                constexpr uint64_t rate = PROTOPUG_FIELD_STATS_SAMPLE_RATE;
+                uint64_t call = counters.calls.fetch_add(1, std::memory_order_relaxed);
+                if (rate != 0 && call % (rate == 0 ? 1 : rate) == 0)
+                {
+                    _sampled = true;
+                    _start = std::chrono::steady_clock::now();
+                }
+            }
+
+            ~field_stats_sample()
+            {
+                if (!_sampled) return;
+
+                auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _start);
+                _counters.samples.fetch_add(1, std::memory_order_relaxed);
+                _counters.sampled_nanoseconds.fetch_add(elapsed.count(), std::memory_order_relaxed);
+            }
+
+        private:
+            field_counters &_counters;
+            bool _sampled = false;
+            std::chrono::steady_clock::time_point _start;
+        };
+
+        struct counting_writer : public writer
+        {
+            explicit counting_writer(writer &parent)
+                : _parent(parent)
+            {}
+
+            void write(const void *bytes, size_t size) override
+            {
+                byte_size += size;
+                _parent.write(bytes, size);
+            }
+
+            size_t byte_size = 0;
+
+        private:
+            writer &_parent;
+        };
+
+        template<class T, class Field>
+        void write_field_with_stats(const T &value, const Field &field, writer &out)
+        {
+            // Size passes would count nested fields twice
+            if (out.size_only)
+            {
+                write_field(value, field, out);
+                return;
+            }
+
+            auto &counters = field_counters_of<T, Field::tag>(field.field_name);
+            counting_writer counting_out(out);
+            {
+                field_stats_sample sample(counters);
+                write_field(value, field, counting_out);
+            }
+
+            if (counting_out.byte_size > 0)
+            {
+                counters.writes.fetch_add(1, std::memory_order_relaxed);
+                counters.written_bytes.fetch_add(counting_out.byte_size, std::memory_order_relaxed);
+            }
+        }
+#endif
+
+        template<class T, class... Field>
+        void write_message(const T &value, const detail::message_impl<Field...> &message, writer &out)
+        {
+            message.visit([&](const auto & field)
+            {
+#if defined(PROTOPUG_WITH_FIELD_STATS)
+                if constexpr(is_oneof_group<std::decay_t<decltype(field)>>::value)
+                {
+                    // Counted per alternative, only the one held is written
+                    size_t index = field.get(value).index();
+                    field.visit([&](const auto & alternative)
+                    {
+                        if (alternative.index == index) write_field_with_stats(value, alternative, out);
+                    });
+                }
+                else
+                {
+                    write_field_with_stats(value, field, out);
+                }
+#else
+                write_field(value, field, out);
+#endif
+            });
+        }
+
+        template<uint32_t Flags, class ValueType, class It>
+        void write_repeated(uint32_t Tag, It begin, It end, writer &out)
+        {
+            if (begin == end) return;
+
+            if constexpr(detail::has_serialize_packed_v<serializer<ValueType>, ValueType, flags_t<Flags>, writer>)
+            {
+                write_varint(make_tag_wire_type(Tag, WireType::LengthDelimeted), out);
+
+                writer_size_collector size_collector;
+                for (auto it = begin; it != end; ++it)
+                {
+                    serializer<ValueType>::serialize_packed(*it, flags_t<Flags> {}, size_collector);
+                }
+
+                write_varint(size_collector.byte_size, out);
+
+                for (auto it = begin; it != end; ++it)
+                {
+                    serializer<ValueType>::serialize_packed(*it, flags_t<Flags> {}, out);
+                }
+            }
+            else
+            {
+                for (auto it = begin; it != end; ++it)
                 {
                     serializer<ValueType>::serialize(Tag, *it, flags_t<Flags>(), out);
                 }
             }
         }
 
+        // Encoded size of a map key or value field, computed without encoding it where the type allows
+        template<uint32_t Flags, class T>
+        size_t map_item_size(uint32_t tag, const T &value)
+        {
+            size_t tag_size = varint_size(tag << 3);
+
+            if constexpr(std::is_same_v<T, std::string>)
+            {
+                return tag_size + varint_size(value.size()) + value.size();
+            }
+            else if constexpr(std::is_same_v<T, bool>)
+            {
+                return tag_size + 1;
+            }
+            else if constexpr(std::is_enum_v<T>)
+            {
+                return map_item_size<Flags>(tag, static_cast<std::underlying_type_t<T>>(value));
+            }
+            else if constexpr(std::is_floating_point_v<T> || (std::is_integral_v<T> && (Flags & flags::f)))
+            {
+                return tag_size + sizeof(T);
+            }
+            else if constexpr(std::is_integral_v<T> && (Flags & flags::s))
+            {
+                return tag_size + varint_size(make_zigzag_value(value));
+            }
+            else if constexpr(std::is_integral_v<T>)
+            {
+                return tag_size + varint_size(static_cast<std::make_unsigned_t<T>>(value));
+            }
+            else
+            {
+                writer_size_collector size_collector;
+                serializer<T>::serialize(tag, value, flags_t<Flags> {}, size_collector, true);
+                return size_collector.byte_size;
+            }
+        }
+
         template<uint32_t KeyFlags, uint32_t ValueFlags, class Key, class Value>
         void write_map_key_value(const std::pair<const Key, Value> &value, writer &out)
         {
@@ -649,23 +1732,40 @@ namespace protopug
             for (auto it = begin; it != end; ++it)
             {
                 write_tag_wire_type(Tag, WireType::LengthDelimeted, out);
-
-                writer_size_collector size_collector;
-                write_map_key_value<KeyFlags, ValueFlags>(*it, size_collector);
-
-                write_varint(size_collector.byte_size, out);
+                write_varint(map_item_size<KeyFlags>(1, it->first) + map_item_size<ValueFlags>(2, it->second), out);
                 write_map_key_value<KeyFlags, ValueFlags>(*it, out);
             }
         }
 
+        // Decodes one entry straight into key and value, unknown fields of the entry are skipped
         template<uint32_t KeyFlags, uint32_t ValueFlags, class Key, class Value>
-        bool read_map_key_value(std::pair<Key, Value> &value, reader &in)
+        bool read_map_key_value(Key &key, Value &value, reader &in)
         {
-            static const auto pair_as_message = message(
-                                               field<1, &std::pair<Key, Value>::first, KeyFlags>("key"),
-                                               field<2, &std::pair<Key, Value>::second, ValueFlags>("value")
-                                           );
-            return read_message(value, pair_as_message, in);
+            uint32_t tag_key;
+            while (read_varint(tag_key, in))
+            {
+                uint32_t tag;
+                WireType wire_type;
+                read_tag_wire_type(tag_key, tag, wire_type);
+
+                bool result;
+                switch (tag)
+                {
+                case 1:
+                    result = serializer<Key>::parse(wire_type, key, flags_t<KeyFlags> {}, in);
+                    break;
+                case 2:
+                    result = serializer<Value>::parse(wire_type, value, flags_t<ValueFlags> {}, in);
+                    break;
+                default:
+                    result = skip_field(wire_type, in);
+                    break;
+                }
+
+                if (!result) return false;
+            }
+
+            return true;
         }
 
         template<uint32_t KeyFlags, uint32_t ValueFlags, class T>
@@ -674,36 +1774,89 @@ namespace protopug
             if (wire_type != WireType::LengthDelimeted) return false;
 
             size_t size;
-            if (read_varint(size, in))
+            if (read_varint(size, in) && size <= in.available_bytes())
             {
                 limited_reader limited_in(in, size);
 
-                while (limited_in.available_bytes() > 0)
+                typename T::key_type key {};
+                typename T::mapped_type mapped {};
+                if (!read_map_key_value<KeyFlags, ValueFlags>(key, mapped, limited_in) || limited_in.available_bytes() != 0)
                 {
-                    std::pair<typename T::key_type, typename T::mapped_type> item;
-                    if (!read_map_key_value<KeyFlags, ValueFlags>(item, limited_in))
-                    {
-                        return false;
-                    }
-
-                    value.insert(std::move(item));
+                    return false;
                 }
 
+                // Entries written from a std::map arrive sorted, so the hint is right and insertion constant time
+                size_t old_size = value.size();
+                value.emplace_hint(value.end(), std::move(key), std::move(mapped));
+
+                if (in.budget && !in.budget->allocate_elements(old_size, value.size(), sizeof(typename T::value_type))) return false;
+
                 return true;
             }
             return false;
         }
 
-        template<uint32_t Flags, class ValueType, class OutputIt>
-        bool read_repeated(WireType wire_type, OutputIt output_it, reader &in)
+        // Number of varints in a packed payload: the bytes without the continuation bit
+        size_t count_varints(const uint8_t *data, size_t size)
+        {
+            size_t count = 0;
+            size_t i = 0;
+#if defined(__SSE2__) && defined(__GNUC__)
+            for (; i + 16 <= size; i += 16)
+            {
+                __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+                count += 16 - __builtin_popcount(_mm_movemask_epi8(bytes));
+            }
+#endif
+            for (; i < size; ++i)
+            {
+                count += data[i] < 0b1000'0000;
+            }
+
+            return count;
+        }
+
+        // Width of an element in a packed field, 0 for varints
+        template<class T, uint32_t Flags>
+        constexpr size_t packed_fixed_size()
+        {
+            return std::is_floating_point_v<T> || (Flags & flags::f) ? sizeof(T) : 0;
+        }
+
+        // Makes room for count more elements, unless that would go past the parse limits. Exact on
+        // the first chunk of a field, later chunks at least double the capacity.
+        template<class T>
+        void reserve_elements(std::vector<T> &value, size_t count, reader &in)
+        {
+            size_t size = value.size() + count;
+            if (size <= value.capacity()) return;
+
+            if (in.budget && (size > in.budget->limits.max_repeated_size || count > in.budget->allocation_left / sizeof(T))) return;
+
+            value.reserve(std::max(size, value.capacity() * 2));
+        }
+
+        template<uint32_t Flags, class ValueType>
+        bool read_repeated(WireType wire_type, std::vector<ValueType> &values, reader &in)
         {
             if constexpr(detail::has_parse_packed_v<serializer<ValueType>, ValueType, flags_t<Flags>, reader>)
             {
                 if (wire_type != WireType::LengthDelimeted) return false;
 
                 size_t size;
-                if (read_varint(size, in))
+                if (read_varint(size, in) && size <= in.available_bytes())
                 {
+                    // The length prefix only sizes the reservation when the input is known to hold it
+                    constexpr size_t fixed_size = packed_fixed_size<ValueType, Flags>();
+                    if constexpr(fixed_size != 0)
+                    {
+                        if (in.size_known()) reserve_elements(values, size / fixed_size, in);
+                    }
+                    else if (auto data = in.peek(size))
+                    {
+                        reserve_elements(values, count_varints(data, size), in);
+                    }
+
                     limited_reader limited_in(in, size);
 
                     while (limited_in.available_bytes() > 0)
@@ -714,73 +1867,496 @@ namespace protopug
                             return false;
                         }
 
-                        output_it = value;
-                        ++output_it;
-                    }
+                        values.push_back(value);
+                    }
+
+                    return true;
+                }
+
+                return false;
+            }
+            else
+            {
+                ValueType value;
+                if (serializer<ValueType>::parse(wire_type, value, flags_t<Flags>(), in))
+                {
+                    values.push_back(std::move(value));
+                    return true;
+                }
+
+                return false;
+            }
+        }
+
+        // Number of length delimited records in a row with tag_key, counting the one whose payload
+        // starts at pos
+        size_t count_record_run(uint32_t tag_key, const uint8_t *pos, const uint8_t *end)
+        {
+            size_t count = 1;
+
+            uint64_t size;
+            if (!read_varint(size, pos, end) || size > static_cast<size_t>(end - pos)) return count;
+            pos += size;
+
+            uint64_t key;
+            while (pos != end && read_varint(key, pos, end) && key == tag_key)
+            {
+                if (!read_varint(size, pos, end) || size > static_cast<size_t>(end - pos)) break;
+
+                pos += size;
+                ++count;
+            }
+
+            return count;
+        }
+
+        // Unpacked repeated fields arrive as runs of records with the same tag. When the vector is
+        // full and the input is in memory, the rest of the run is counted and reserved at once.
+        template<class T>
+        void reserve_record_run(std::vector<T> &value, uint32_t tag, WireType wire_type, reader &in)
+        {
+            if (wire_type != WireType::LengthDelimeted || value.size() != value.capacity()) return;
+
+            size_t size = in.available_bytes();
+            if (size == SIZE_MAX) return;
+
+            auto data = in.peek(size);
+            if (!data) return;
+
+            reserve_elements(value, count_record_run(make_tag_wire_type(tag, WireType::LengthDelimeted), data, data + size), in);
+        }
+
+        // Bools and enums below 128 take exactly one byte each in a packed field, so whole
+        // payloads are converted in chunks instead of element by element.
+        template<class T>
+        constexpr bool is_small_varint_v = std::is_same_v<T, bool> || std::is_enum_v<T>;
+
+        constexpr size_t small_varint_chunk_size = 256;
+
+        template<class T>
+        void write_small_varints(uint32_t tag, const std::vector<T> &value, writer &out)
+        {
+            if (value.empty()) return;
+
+            if constexpr(std::is_enum_v<T>)
+            {
+                using Bits = std::make_unsigned_t<std::underlying_type_t<T>>;
+
+                Bits high_bits = 0;
+                for (auto item : value)
+                {
+                    high_bits |= static_cast<Bits>(item);
+                }
+
+                if (high_bits >= 0b1000'0000)
+                {
+                    write_repeated<flags::no, T>(tag, value.begin(), value.end(), out);
+                    return;
+                }
+            }
+
+            write_tag_wire_type(tag, WireType::LengthDelimeted, out);
+            write_varint(value.size(), out);
+
+            uint8_t chunk[small_varint_chunk_size];
+            for (size_t i = 0; i < value.size(); i += small_varint_chunk_size)
+            {
+                size_t count = std::min(small_varint_chunk_size, value.size() - i);
+                for (size_t j = 0; j < count; ++j)
+                {
+                    chunk[j] = static_cast<uint8_t>(value[i + j]);
+                }
+                out.write(chunk, count);
+            }
+        }
+
+        template<class T>
+        T small_varint_value(uint8_t byte)
+        {
+            if constexpr(std::is_same_v<T, bool>)
+            {
+                return byte != 0;
+            }
+            else
+            {
+                return static_cast<T>(byte);
+            }
+        }
+
+#if defined(__SSE2__) && defined(__GNUC__)
+        // Widens 16 one byte varints to T
+        template<class T>
+        void store_small_varints(__m128i bytes, T *items)
+        {
+            const __m128i zero = _mm_setzero_si128();
+            auto store = [&](__m128i values, size_t index)
+            {
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(items + index), values);
+            };
+
+            if constexpr(std::is_same_v<T, bool>)
+            {
+                static_assert(sizeof(bool) == 1, "bool is a byte");
+                store(_mm_andnot_si128(_mm_cmpeq_epi8(bytes, zero), _mm_set1_epi8(1)), 0);
+            }
+            else if constexpr(sizeof(T) == 1)
+            {
+                store(bytes, 0);
+            }
+            else
+            {
+                __m128i words[2] = {_mm_unpacklo_epi8(bytes, zero), _mm_unpackhi_epi8(bytes, zero)};
+                if constexpr(sizeof(T) == 2)
+                {
+                    store(words[0], 0);
+                    store(words[1], 8);
+                }
+                else
+                {
+                    for (size_t i = 0; i < 2; ++i)
+                    {
+                        __m128i dwords[2] = {_mm_unpacklo_epi16(words[i], zero), _mm_unpackhi_epi16(words[i], zero)};
+                        for (size_t j = 0; j < 2; ++j)
+                        {
+                            if constexpr(sizeof(T) == 4)
+                            {
+                                store(dwords[j], i * 8 + j * 4);
+                            }
+                            else
+                            {
+                                store(_mm_unpacklo_epi32(dwords[j], zero), i * 8 + j * 4);
+                                store(_mm_unpackhi_epi32(dwords[j], zero), i * 8 + j * 4 + 2);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+#endif
+
+        // Converts the leading one byte varints of bytes into items, returns how many there were.
+        // Continuation bits are checked and values widened in the same sweep, 16 bytes at a time.
+        template<class T>
+        size_t convert_small_varints(const uint8_t *bytes, size_t count, T *items)
+        {
+            size_t i = 0;
+#if defined(__SSE2__) && defined(__GNUC__)
+            for (; i + 16 <= count; i += 16)
+            {
+                __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + i));
+                if (_mm_movemask_epi8(chunk) != 0) break;
+
+                store_small_varints(chunk, items + i);
+            }
+#endif
+            for (; i < count && bytes[i] < 0b1000'0000; ++i)
+            {
+                items[i] = small_varint_value<T>(bytes[i]);
+            }
+
+            return i;
+        }
+
+        // Appends the leading one byte varints of bytes, returns how many there were
+        template<class T>
+        size_t append_small_varints(std::vector<T> &value, const uint8_t *bytes, size_t count)
+        {
+            if constexpr(std::is_same_v<T, bool>)
+            {
+                // std::vector<bool> packs bits, so items go through a chunk of bools
+                bool items[small_varint_chunk_size];
+                size_t converted = convert_small_varints(bytes, count, items);
+                value.insert(value.end(), items, items + converted);
+                return converted;
+            }
+            else
+            {
+                size_t size = value.size();
+                value.resize(size + count);
+
+                size_t converted = convert_small_varints(bytes, count, value.data() + size);
+                value.resize(size + converted);
+                return converted;
+            }
+        }
+
+        template<class T>
+        bool read_small_varints(WireType wire_type, std::vector<T> &value, reader &in)
+        {
+            if (wire_type != WireType::LengthDelimeted) return false;
+
+            size_t size;
+            if (!read_varint(size, in) || size > in.available_bytes()) return false;
+
+            // Without a view of the payload its size bounds the count, every item takes a byte at least;
+            // that bound is only trusted when the input is known to hold it
+            auto data = in.peek(size);
+            if (data || in.size_known()) reserve_elements(value, data ? count_varints(data, size) : size, in);
+
+            uint8_t chunk[small_varint_chunk_size];
+            size_t carry = 0;
+            while (size > 0)
+            {
+                size_t read_size = std::min(size, small_varint_chunk_size - carry);
+                if (in.read(chunk + carry, read_size) != read_size) return false;
+                size -= read_size;
+
+                const uint8_t *pos = chunk;
+                const uint8_t *end = chunk + carry + read_size;
+                carry = 0;
+
+                while (pos != end)
+                {
+                    pos += append_small_varints(value, pos, end - pos);
+                    if (pos == end) break;
+
+                    const uint8_t *start = pos;
+                    uint64_t item;
+                    if (!read_varint(item, pos, end))
+                    {
+                        // A varint split by the chunk boundary is finished with the next chunk
+                        if (size == 0 || end - start >= 10) return false;
+
+                        carry = end - start;
+                        std::memmove(chunk, start, carry);
+                        break;
+                    }
+
+                    if constexpr(std::is_same_v<T, bool>)
+                    {
+                        value.push_back(item != 0);
+                    }
+                    else
+                    {
+                        value.push_back(static_cast<T>(static_cast<std::underlying_type_t<T>>(item)));
+                    }
+                }
+            }
+
+            return true;
+        }
+
+        // read_field returns false only for fields declared with flags::utf8 that failed to parse, other
+        // fields keep going past malformed values
+        template<class T, uint32_t Tag, size_t Index, class MemPtrT, MemPtrT MemPtr, uint32_t Flags>
+        bool read_field(T &value, uint32_t tag, WireType wire_type, const detail::oneof_field_impl<Tag, Index, MemPtrT, MemPtr, Flags> &/*field*/,
+                        reader &in)
+        {
+            if (Tag != tag) return true;
+
+            using OneOf = detail::oneof_field_impl<Tag, Index, MemPtrT, MemPtr, Flags>;
+            return serializer<typename OneOf::member_type>::template parse_oneof<OneOf::index>(wire_type, OneOf::get(value), flags_t<OneOf::flags>(), in)
+                   || !(Flags & flags::utf8);
+        }
+
+        template<class T, uint32_t Tag, class MemPtrT, MemPtrT MemPtr, uint32_t KeyFlags, uint32_t ValueFlags>
+        bool read_field(T &value, uint32_t tag, WireType wire_type, const detail::map_field_impl<Tag, MemPtrT, MemPtr, KeyFlags, ValueFlags> &/*field*/,
+                        reader &in)
+        {
+            if (Tag != tag) return true;
+
+            using Map = detail::map_field_impl<Tag, MemPtrT, MemPtr, KeyFlags, ValueFlags>;
+            return serializer<typename Map::member_type>::parse_map(wire_type, Map::get(value), flags_t<Map::key_flags>(), flags_t<Map::value_flags>(),
+                    in) || !((KeyFlags | ValueFlags) & flags::utf8);
+        }
+
+        template<class T, uint32_t Tag, class MemPtrT, MemPtrT MemPtr, uint32_t Flags>
+        bool read_field(T &value, uint32_t tag, WireType wire_type, const detail::field_impl<Tag, MemPtrT, MemPtr, Flags> &/*field*/, reader &in)
+        {
+            if (Tag != tag) return true;
+
+            using Field = detail::field_impl<Tag, MemPtrT, MemPtr, Flags>;
+            if constexpr(is_specialization_of<typename Field::member_type, std::vector>::value)
+            {
+                using ValueType = typename Field::member_type::value_type;
+                if constexpr(!has_parse_packed_v<serializer<ValueType>, ValueType, flags_t<Flags>, reader>)
+                {
+                    reserve_record_run(Field::get(value), Tag, wire_type, in);
+                }
+            }
+
+            return serializer<typename Field::member_type>::parse(wire_type, Field::get(value), flags_t<Field::flags>(), in) || !(Flags & flags::utf8);
+        }
+
+#if defined(PROTOPUG_WITH_FIELD_STATS)
+        struct counting_reader : public reader
+        {
+            explicit counting_reader(reader &parent)
+                : _parent(parent)
+            {
+                budget = parent.budget;
+            }
+
+            size_t read(void *bytes, size_t size) override
+            {
+                auto read_size = _parent.read(bytes, size);
+                byte_size += read_size;
+                return read_size;
+            }
+
+            size_t available_bytes() const override
+            {
+                return _parent.available_bytes();
+            }
+
+            bool size_known() const override
+            {
+                return _parent.size_known();
+            }
+
+            size_t decode_varint(uint64_t &value, size_t max_size) override
+            {
+                auto size = _parent.decode_varint(value, max_size);
+                byte_size += size;
+                return size;
+            }
+
+            bool read_utf8(void *bytes, size_t size) override
+            {
+                byte_size += size;
+                return _parent.read_utf8(bytes, size);
+            }
+
+            const uint8_t *peek(size_t size) override
+            {
+                return _parent.peek(size);
+            }
+
+            size_t byte_size = 0;
+
+        private:
+            reader &_parent;
+        };
+
+        template<class T, class Field>
+        bool read_field_with_stats(T &value, uint32_t tag_key, const Field &field, reader &in)
+        {
+            uint32_t tag;
+            WireType wire_type;
+            read_tag_wire_type(tag_key, tag, wire_type);
 
-                    return true;
-                }
+            if (is_specialization_of<T, std::pair>::value || Field::tag != tag)
+            {
+                return read_field(value, tag, wire_type, field, in);
+            }
 
-                return false;
+            auto &counters = field_counters_of<T, Field::tag>(field.field_name);
+            counting_reader counting_in(in);
+            bool ok;
+            {
+                field_stats_sample sample(counters);
+                ok = read_field(value, tag, wire_type, field, counting_in);
             }
-            else
+
+            counters.reads.fetch_add(1, std::memory_order_relaxed);
+            counters.read_bytes.fetch_add(varint_size(tag_key) + counting_in.byte_size, std::memory_order_relaxed);
+            return ok;
+        }
+#endif
+
+        // Reads alternative J of field I when that is a oneof group
+        template<class T, class Message, size_t I, size_t J>
+        bool read_field_at(T &value, uint32_t tag_key, const Message &message, reader &in)
+        {
+            const auto &field = [&]() -> const auto &
             {
-                ValueType value;
-                if (serializer<ValueType>::parse(wire_type, value, flags_t<Flags>(), in))
+                if constexpr(is_oneof_group<std::decay_t<decltype(message.template get<I>())>>::value)
                 {
-                    output_it = value;
-                    ++output_it;
-                    return true;
+                    return std::get<J>(message.template get<I>().alternatives);
+                }
+                else
+                {
+                    return message.template get<I>();
                 }
+            }();
 
-                return false;
-            }
+#if defined(PROTOPUG_WITH_FIELD_STATS)
+            return read_field_with_stats(value, tag_key, field, in);
+#else
+            uint32_t tag;
+            WireType wire_type;
+            read_tag_wire_type(tag_key, tag, wire_type);
+
+            return read_field(value, tag, wire_type, field, in);
+#endif
         }
 
-        template<class T, uint32_t Tag, size_t Index, class MemPtrT, MemPtrT MemPtr, uint32_t Flags>
-        void read_field(T &value, uint32_t tag, WireType wire_type, const detail::oneof_field_impl<Tag, Index, MemPtrT, MemPtr, Flags> &/*field*/,
-                        reader &in)
+        // Tag and reader of every field in descriptor order, oneof groups take one entry per alternative
+        template<class T, class Message, class Indices = std::make_index_sequence<message_field_count<Message>::value>>
+        struct field_dispatch;
+
+        template<class T, class... Field, size_t... I>
+        struct field_dispatch<T, message_impl<Field...>, std::index_sequence<I...>>
         {
-            if (Tag != tag) return;
+            using read_function = bool (*)(T &value, uint32_t tag_key, const message_impl<Field...> &message, reader &in);
 
-            using OneOf = detail::oneof_field_impl<Tag, Index, MemPtrT, MemPtr, Flags>;
-            serializer<typename OneOf::member_type>::template parse_oneof<OneOf::index>(wire_type, OneOf::get(value), flags_t<OneOf::flags>(), in);
-        }
+            constexpr static const size_t count = message_field_count<flat_message_t<message_impl<Field...>>>::value;
 
-        template<class T, uint32_t Tag, class MemPtrT, MemPtrT MemPtr, uint32_t KeyFlags, uint32_t ValueFlags>
-        void read_field(T &value, uint32_t tag, WireType wire_type, const detail::map_field_impl<Tag, MemPtrT, MemPtr, KeyFlags, ValueFlags> &/*field*/,
-                        reader &in)
-        {
-            if (Tag != tag) return;
+            template<size_t Index, size_t... J>
+            static constexpr void add(std::array<uint32_t, count + 1> &tags, std::array<read_function, count + 1> &read, size_t &next,
+                                      std::index_sequence<J...>)
+            {
+                using Alternatives = typename field_alternatives<std::tuple_element_t<Index, std::tuple<Field...>>>::type;
+                ((tags[next] = std::tuple_element_t<J, Alternatives>::tag, read[next] = &read_field_at<T, message_impl<Field...>, Index, J>, ++next), ...);
+            }
 
-            using Map = detail::map_field_impl<Tag, MemPtrT, MemPtr, KeyFlags, ValueFlags>;
-            serializer<typename Map::member_type>::parse_map(wire_type, Map::get(value), flags_t<Map::key_flags>(), flags_t<Map::value_flags>(), in);
-        }
+            struct entries
+            {
+                std::array<uint32_t, count + 1> tags {};
+                std::array<read_function, count + 1> read {};
+            };
 
-        template<class T, uint32_t Tag, class MemPtrT, MemPtrT MemPtr, uint32_t Flags>
-        void read_field(T &value, uint32_t tag, WireType wire_type, const detail::field_impl<Tag, MemPtrT, MemPtr, Flags> &/*field*/, reader &in)
-        {
-            if (Tag != tag) return;
+            static constexpr entries make()
+            {
+                entries result {};
+                size_t next = 0;
+                (add<I>(result.tags, result.read, next, std::make_index_sequence<std::tuple_size_v<typename field_alternatives<Field>::type>>()), ...);
+                return result;
+            }
 
-            using Field = detail::field_impl<Tag, MemPtrT, MemPtr, Flags>;
-            serializer<typename Field::member_type>::parse(wire_type, Field::get(value), flags_t<Field::flags>(), in);
-        }
+            constexpr static const entries table = make();
+            constexpr static const auto &tags = table.tags;
+            constexpr static const auto &read = table.read;
+
+            // count when no field has the tag
+            static size_t find(uint32_t tag)
+            {
+                for (size_t i = 0; i < count; ++i)
+                {
+                    if (tags[i] == tag) return i;
+                }
+
+                return count;
+            }
+        };
 
         template<class T, class... Field>
         bool read_message(T &value, const message_impl<Field...> &message, reader &in)
         {
+            using dispatch = field_dispatch<T, message_impl<Field...>>;
+
+            // Encoders write fields in descriptor order, so the next tag is most likely the one just
+            // read again or the one after it. Everything else takes a search over all tags.
+            size_t expected = 0;
+
             uint32_t tag_key;
             while (read_varint(tag_key, in))
             {
-                uint32_t tag;
-                WireType wire_type;
+                uint32_t tag = tag_key >> 3;
 
-                read_tag_wire_type(tag_key, tag, wire_type);
+                size_t index = expected;
+                if (index == dispatch::count || dispatch::tags[index] != tag)
+                {
+                    index = (index + 1 < dispatch::count && dispatch::tags[index + 1] == tag) ? index + 1 : dispatch::find(tag);
+                }
 
-                message.visit([&](const auto & field)
+                if (index != dispatch::count)
                 {
-                    read_field(value, tag, wire_type, field, in);
-                });
+                    expected = index;
+                    if (!dispatch::read[index](value, tag_key, message, in)) return false;
+                }
+
+                if (in.budget && in.budget->exceeded) return false;
             }
 
             return true;
@@ -808,13 +2384,19 @@ namespace protopug
             if (wire_type != WireType::LengthDelimeted) return false;
 
             size_t size;
-            if (detail::read_varint(size, in))
+            if (!detail::read_varint(size, in) || size > in.available_bytes()) return false;
+
+            detail::limited_reader limited_in(in, size);
+            if (!in.budget)
             {
-                detail::limited_reader limited_in(in, size);
                 return detail::read_message(value, message_type<T>(), limited_in);
             }
 
-            return false;
+            if (!in.budget->enter()) return false;
+
+            bool result = detail::read_message(value, message_type<T>(), limited_in);
+            in.budget->leave();
+            return result;
         }
     };
 
@@ -1221,16 +2803,35 @@ namespace protopug
             if (wire_type != WireType::LengthDelimeted) return false;
 
             size_t size;
-            if (detail::read_varint(size, in))
+            if (!detail::read_varint(size, in) || size > in.available_bytes()) return false;
+
+            if (in.budget && !in.budget->allocate_string(size)) return false;
+
+            return detail::read_string(value, size, in);
+        }
+
+        static void serialize(uint32_t tag, const std::string &value, flags_t<flags::utf8>, writer &out, bool force = false)
+        {
+            serialize(tag, value, flags_t<>(), out, force);
+        }
+
+        // Fails on invalid UTF-8, readers over memory check the bytes while copying them
+        static bool parse(WireType wire_type, std::string &value, flags_t<flags::utf8>, reader &in)
+        {
+            if (wire_type != WireType::LengthDelimeted) return false;
+
+            size_t size;
+            if (!detail::read_varint(size, in) || size > in.available_bytes()) return false;
+
+            if (in.budget && !in.budget->allocate_string(size)) return false;
+
+            if (!in.size_known())
             {
-                value.resize(size);
-                if (in.read(value.data(), size) == size)
-                {
-                    return true;
-                }
+                return detail::read_string(value, size, in) && detail::is_valid_utf8(reinterpret_cast<const uint8_t *>(value.data()), size);
             }
 
-            return false;
+            value.resize(size);
+            return in.read_utf8(value.data(), size);
         }
     };
 
@@ -1240,13 +2841,34 @@ namespace protopug
         template<uint32_t Flags>
         static void serialize(uint32_t tag, const std::vector<T> &value, flags_t<Flags>, writer &out)
         {
-            detail::write_repeated<Flags, T>(tag, value.begin(), value.end(), out);
+            if constexpr(Flags == flags::no && detail::is_small_varint_v<T>)
+            {
+                detail::write_small_varints(tag, value, out);
+            }
+            else
+            {
+                detail::write_repeated<Flags, T>(tag, value.begin(), value.end(), out);
+            }
         }
 
         template<uint32_t Flags>
         static bool parse(WireType wire_type, std::vector<T> &value, flags_t<Flags>, reader &in)
         {
-            return detail::read_repeated<Flags, T>(wire_type, std::back_inserter(value), in);
+            size_t old_size = value.size();
+
+            bool result;
+            if constexpr(Flags == flags::no && detail::is_small_varint_v<T>)
+            {
+                result = detail::read_small_varints(wire_type, value, in);
+            }
+            else
+            {
+                result = detail::read_repeated<Flags, T>(wire_type, value, in);
+            }
+
+            if (in.budget && !in.budget->allocate_elements(old_size, value.size(), sizeof(T))) return false;
+
+            return result;
         }
     };
 
@@ -1276,14 +2898,22 @@ namespace protopug
         {
             if (value.index() != Index) return;
 
-            serializer<std::variant_alternative_t<Index, std::variant<T...>>>::serialize(tag, std::get<Index>(value), flags_t<Flags>(), out);
+            serialize_alternative<Index>(tag, value, flags_t<Flags>(), out);
+        }
+
+        // value has to hold alternative Index
+        template<size_t Index, uint32_t Flags>
+        static void serialize_alternative(uint32_t tag, const std::variant<T...> &value, flags_t<Flags>, writer &out)
+        {
+            serializer<std::variant_alternative_t<Index, std::variant<T...>>>::serialize(tag, *std::get_if<Index>(&value), flags_t<Flags>(), out);
         }
 
+        // Parses into the alternative already held, its buffers are reused and messages merged
         template<size_t Index, uint32_t Flags>
         static bool parse_oneof(WireType wire_type, std::variant<T...> &value, flags_t<Flags>, reader &in)
         {
-            return serializer<std::variant_alternative_t<Index, std::variant<T...>>>::parse(wire_type, value.template emplace<Index>(),
-                    flags_t<Flags>(), in);
+            auto &alternative = value.index() == Index ? *std::get_if<Index>(&value) : value.template emplace<Index>();
+            return serializer<std::variant_alternative_t<Index, std::variant<T...>>>::parse(wire_type, alternative, flags_t<Flags>(), in);
         }
     };
 
@@ -1317,6 +2947,101 @@ namespace protopug
         std::string &_out;
     };
 
+    // Writes into caller provided memory and never allocates. Writes past the end are only counted,
+    // so size() is the required buffer size when overflow() is set.
+    struct buffer_writer : public writer
+    {
+        buffer_writer(void *data, size_t size)
+            : _data(reinterpret_cast<uint8_t *>(data))
+            , _size(size)
+            , _pos(0)
+        {}
+
+        void write(const void *bytes, size_t size) override
+        {
+            if (_pos <= _size && size <= _size - _pos)
+            {
+                memcpy(_data + _pos, bytes, size);
+            }
+            _pos += size;
+        }
+
+        size_t size() const
+        {
+            return _pos;
+        }
+
+        bool overflow() const
+        {
+            return _pos > _size;
+        }
+
+    private:
+        uint8_t *_data;
+        size_t _size;
+        size_t _pos;
+    };
+
+    // Keeps up to Capacity bytes in place and moves to the heap only when a message outgrows them
+    template<size_t Capacity = 256>
+    struct inline_writer : public writer
+    {
+        inline_writer() = default;
+
+        inline_writer(const inline_writer &) = delete;
+        inline_writer &operator=(const inline_writer &) = delete;
+
+        void write(const void *bytes, size_t size) override
+        {
+            if (!_spilled)
+            {
+                if (size <= Capacity - _size)
+                {
+                    memcpy(_inline + _size, bytes, size);
+                    _size += size;
+                    return;
+                }
+
+                _heap.reserve(std::max(Capacity * 2, _size + size));
+                _heap.assign(_inline, _inline + _size);
+                _spilled = true;
+            }
+
+            auto data = reinterpret_cast<const uint8_t *>(bytes);
+            _heap.insert(_heap.end(), data, data + size);
+            _size += size;
+        }
+
+        const uint8_t *data() const
+        {
+            return _spilled ? _heap.data() : _inline;
+        }
+
+        size_t size() const
+        {
+            return _size;
+        }
+
+        bool spilled() const
+        {
+            return _spilled;
+        }
+
+        // Keeps the heap buffer, if any, for the next message
+        void clear()
+        {
+            _heap.clear();
+            _size = 0;
+            _spilled = false;
+        }
+
+    private:
+        uint8_t _inline[Capacity];
+        std::vector<uint8_t> _heap;
+        size_t _size = 0;
+        bool _spilled = false;
+    };
+
     struct string_reader : public reader
     {
         string_reader(const std::string &in)
@@ -1332,11 +3057,137 @@ namespace protopug
             return read_size;
         }
 
+        size_t available_bytes() const override
+        {
+            return _in.size() - _pos;
+        }
+
+        size_t decode_varint(uint64_t &value, size_t max_size) override
+        {
+            if (_in.size() - _pos < detail::varint_slack) return reader::decode_varint(value, max_size);
+
+            size_t size = detail::decode_varint_unchecked(value, reinterpret_cast<const uint8_t *>(_in.data()) + _pos, max_size);
+            _pos += size;
+            return size;
+        }
+
+        bool read_utf8(void *bytes, size_t size) override
+        {
+            if (_in.size() - _pos < size) return reader::read_utf8(bytes, size);
+
+            bool valid = detail::copy_utf8(static_cast<uint8_t *>(bytes), reinterpret_cast<const uint8_t *>(_in.data()) + _pos, size);
+            _pos += size;
+            return valid;
+        }
+
+        const uint8_t *peek(size_t size) override
+        {
+            return _in.size() - _pos < size ? nullptr : reinterpret_cast<const uint8_t *>(_in.data()) + _pos;
+        }
+
     private:
         const std::string &_in;
         size_t _pos;
     };
 
+    struct buffer_reader : public reader
+    {
+        buffer_reader(const void *data, size_t size)
+            : _data(reinterpret_cast<const uint8_t *>(data))
+            , _size(size)
+            , _pos(0)
+        {}
+
+        size_t read(void *bytes, size_t size) override
+        {
+            size_t read_size = std::min(size, _size - _pos);
+            memcpy(bytes, _data + _pos, read_size);
+            _pos += read_size;
+            return read_size;
+        }
+
+        size_t available_bytes() const override
+        {
+            return _size - _pos;
+        }
+
+        size_t decode_varint(uint64_t &value, size_t max_size) override
+        {
+            if (_size - _pos < detail::varint_slack) return reader::decode_varint(value, max_size);
+
+            size_t size = detail::decode_varint_unchecked(value, _data + _pos, max_size);
+            _pos += size;
+            return size;
+        }
+
+        bool read_utf8(void *bytes, size_t size) override
+        {
+            if (_size - _pos < size) return reader::read_utf8(bytes, size);
+
+            bool valid = detail::copy_utf8(static_cast<uint8_t *>(bytes), _data + _pos, size);
+            _pos += size;
+            return valid;
+        }
+
+        const uint8_t *peek(size_t size) override
+        {
+            return _size - _pos < size ? nullptr : _data + _pos;
+        }
+
+    private:
+        const uint8_t *_data;
+        size_t _size;
+        size_t _pos;
+    };
+
+    template <class T>
+    void serialize_to_writer(const T &value, writer &out)
+    {
+        detail::write_message(value, message_type<T>(), out);
+    }
+
+    template <class T>
+    bool parse_from_reader(T &value, reader &in)
+    {
+        return detail::read_message(value, message_type<T>(), in);
+    }
+
+    // Fails as soon as one of the limits is exceeded
+    template <class T>
+    bool parse_from_reader(T &value, reader &in, const parse_limits &limits)
+    {
+        detail::parse_budget budget(limits);
+
+        // Only carries the budget, a reader of unknown size stays one
+        detail::limited_reader bounded_in(in, in.available_bytes());
+        bounded_in.budget = &budget;
+
+        return detail::read_message(value, message_type<T>(), bounded_in) && !budget.exceeded;
+    }
+
+    // Writes value prefixed with its size as varint, so that several messages can follow each other in one stream
+    template <class T>
+    void serialize_delimited_to_writer(const T &value, writer &out)
+    {
+        detail::writer_size_collector size_collector;
+        detail::write_message(value, message_type<T>(), size_collector);
+
+        detail::write_varint(size_collector.byte_size, out);
+        detail::write_message(value, message_type<T>(), out);
+    }
+
+    // Reads the next message written by serialize_delimited_to_writer. False at the end of the stream
+    // or when the message is truncated.
+    template <class T>
+    bool parse_delimited_from_reader(T &value, reader &in)
+    {
+        size_t size;
+        if (!detail::read_varint(size, in) || size > in.available_bytes()) return false;
+
+        detail::limited_reader limited_in(in, size);
+        return detail::read_message(value, message_type<T>(), limited_in) && limited_in.available_bytes() == 0;
+    }
+
     template <class T>
     void serialize_to_string(const T &value, std::string &out)
     {
@@ -1352,11 +3203,125 @@ namespace protopug
         return out;
     }
 
+    // Returns the encoded size; nothing past size bytes is written, a result larger than size means
+    // the buffer was too small
+    template <class T>
+    size_t serialize_into(const T &value, void *data, size_t size)
+    {
+        buffer_writer buffer_out(data, size);
+        detail::write_message(value, message_type<T>(), buffer_out);
+        return buffer_out.size();
+    }
+
+#if __cplusplus >= 202002L
+    template <class T>
+    size_t serialize_into(const T &value, std::span<std::byte> out)
+    {
+        return serialize_into(value, out.data(), out.size());
+    }
+#endif
+
     template <class T>
     bool parse_from_string(T &value, const std::string &in)
     {
         string_reader string_in(in);
         return detail::read_message(value, message_type<T>(), string_in);
     }
+
+    template <class T>
+    bool parse_from_string(T &value, const std::string &in, const parse_limits &limits)
+    {
+        string_reader string_in(in);
+        return parse_from_reader(value, string_in, limits);
+    }
+
+#if defined(PROTOPUG_WITH_FIELD_STATS)
+    struct field_stats
+    {
+        std::string message_type;
+        std::string field_name;
+        uint32_t tag;
+        // Times the field was written (default values are not, repeated fields count once) and
+        // occurrences of it read
+        uint64_t writes;
+        uint64_t written_bytes;
+        uint64_t reads;
+        uint64_t read_bytes;
+        // Timed occurrences, see PROTOPUG_FIELD_STATS_SAMPLE_RATE
+        uint64_t samples;
+        uint64_t sampled_nanoseconds;
+    };
+
+    // Counters of every field seen so far, per message type and tag
+    std::vector<field_stats> get_field_stats()
+    {
+        auto &registry = detail::field_stats_registry::instance();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+
+        std::vector<field_stats> result;
+        result.reserve(registry.counters.size());
+        for (const auto &counters : registry.counters)
+        {
+            std::string message_type = counters->message_type.name();
+#if defined(__GNUG__)
+            int status;
+            char *demangled = abi::__cxa_demangle(message_type.c_str(), nullptr, nullptr, &status);
+            if (status == 0 && demangled)
+            {
+                message_type = demangled;
+            }
+            std::free(demangled);
+#endif
+            result.push_back(field_stats {message_type, counters->field_name, counters->tag,
+                                          counters->writes.load(std::memory_order_relaxed), counters->written_bytes.load(std::memory_order_relaxed),
+                                          counters->reads.load(std::memory_order_relaxed), counters->read_bytes.load(std::memory_order_relaxed),
+                                          counters->samples.load(std::memory_order_relaxed), counters->sampled_nanoseconds.load(std::memory_order_relaxed)});
+        }
+
+        return result;
+    }
+
+    void reset_field_stats()
+    {
+        auto &registry = detail::field_stats_registry::instance();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+
+        for (auto &counters : registry.counters)
+        {
+            for (auto *counter : {&counters->calls, &counters->writes, &counters->written_bytes, &counters->reads, &counters->read_bytes,
+                                  &counters->samples, &counters->sampled_nanoseconds})
+            {
+                counter->store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // One line per field, heaviest fields (by bytes written and read) first
+    std::string field_stats_report()
+    {
+        auto stats = get_field_stats();
+        std::stable_sort(stats.begin(), stats.end(), [](const field_stats & a, const field_stats & b)
+        {
+            return a.written_bytes + a.read_bytes > b.written_bytes + b.read_bytes;
+        });
+
+        std::string report = "message\tfield\ttag\twrites\twritten_bytes\treads\tread_bytes\tavg_ns\n";
+        for (const auto &field : stats)
+        {
+            char numbers[160];
+            std::snprintf(numbers, sizeof(numbers), "\t%u\t%llu\t%llu\t%llu\t%llu\t%llu\n", field.tag,
+                          static_cast<unsigned long long>(field.writes), static_cast<unsigned long long>(field.written_bytes),
+                          static_cast<unsigned long long>(field.reads), static_cast<unsigned long long>(field.read_bytes),
+                          static_cast<unsigned long long>(field.samples == 0 ? 0 : field.sampled_nanoseconds / field.samples));
+
+            report += field.message_type;
+            report += '\t';
+            report += field.field_name;
+            report += numbers;
+        }
+
+        return report;
+    }
+#endif
 }
 
@@ -0,0 +1,382 @@
+#pragma once
+
+// Framed log of records for durable storage. Every frame is
+//   magic (4) | payload size (4) | CRC32C of the 8 bytes before (4) | CRC32C of the payload (4) | payload
+// little-endian, checksums masked like LevelDB's so that logs of logs don't checksum to constants.
+// The header checksum lets a reader trust the size before reading the payload, the magic lets it
+// find the next frame after a damaged one.
+
+#include "protopug.h"
+
+#include <algorithm>
+
+namespace protopug
+{
+    namespace detail
+    {
+        constexpr static const uint32_t record_frame_magic = 0x31475550; // "PUG1"
+        constexpr static const size_t record_frame_header_size = 16;
+
+        struct crc32c_table
+        {
+            crc32c_table()
+            {
+                for (uint32_t i = 0; i < 256; ++i)
+                {
+                    uint32_t crc = i;
+                    for (int bit = 0; bit < 8; ++bit)
+                    {
+                        crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+                    }
+                    values[0][i] = crc;
+                }
+
+                for (uint32_t i = 0; i < 256; ++i)
+                {
+                    for (size_t k = 1; k < 8; ++k)
+                    {
+                        values[k][i] = (values[k - 1][i] >> 8) ^ values[0][values[k - 1][i] & 0xFF];
+                    }
+                }
+            }
+
+            uint32_t values[8][256];
+        };
+
+        // Slicing-by-8
+        uint32_t crc32c_extend_table(uint32_t crc, const uint8_t *data, size_t size)
+        {
+            static const crc32c_table table;
+            const auto &t = table.values;
+
+            crc = ~crc;
+            for (; size >= 8; data += 8, size -= 8)
+            {
+                uint64_t word;
+                std::memcpy(&word, data, sizeof(word));
+                word ^= crc;
+                crc = t[7][word & 0xFF] ^ t[6][(word >> 8) & 0xFF] ^ t[5][(word >> 16) & 0xFF] ^ t[4][(word >> 24) & 0xFF]
+                      ^ t[3][(word >> 32) & 0xFF] ^ t[2][(word >> 40) & 0xFF] ^ t[1][(word >> 48) & 0xFF] ^ t[0][word >> 56];
+            }
+
+            for (; size > 0; ++data, --size)
+            {
+                crc = (crc >> 8) ^ t[0][(crc ^ *data) & 0xFF];
+            }
+
+            return ~crc;
+        }
+
+#if defined(__x86_64__) && defined(__GNUC__)
+        __attribute__((target("sse4.2"))) uint32_t crc32c_extend_sse42(uint32_t crc, const uint8_t *data, size_t size)
+        {
+            uint64_t value = ~crc;
+            for (; size >= 8; data += 8, size -= 8)
+            {
+                uint64_t word;
+                std::memcpy(&word, data, sizeof(word));
+                value = _mm_crc32_u64(value, word);
+            }
+
+            auto crc32 = static_cast<uint32_t>(value);
+            for (; size > 0; ++data, --size)
+            {
+                crc32 = _mm_crc32_u8(crc32, *data);
+            }
+
+            return ~crc32;
+        }
+#endif
+
+        using crc32c_function = uint32_t (*)(uint32_t crc, const uint8_t *data, size_t size);
+
+        crc32c_function select_crc32c()
+        {
+#if defined(__x86_64__) && defined(__GNUC__)
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("sse4.2")) return &crc32c_extend_sse42;
+#endif
+            return &crc32c_extend_table;
+        }
+
+        // Continues crc over size more bytes, start with 0
+        uint32_t crc32c_extend(uint32_t crc, const uint8_t *data, size_t size)
+        {
+            static const crc32c_function extend = select_crc32c();
+            return extend(crc, data, size);
+        }
+
+        uint32_t masked_crc32c(const uint8_t *data, size_t size)
+        {
+            uint32_t crc = crc32c_extend(0, data, size);
+            return ((crc >> 15) | (crc << 17)) + 0xA282EAD8;
+        }
+
+        uint32_t load_le32(const uint8_t *data)
+        {
+            uint32_t value;
+            std::memcpy(&value, data, sizeof(value));
+            return value;
+        }
+
+        void store_le32(uint8_t *data, uint32_t value)
+        {
+            std::memcpy(data, &value, sizeof(value));
+        }
+    }
+
+    uint32_t crc32c(const void *data, size_t size)
+    {
+        return detail::crc32c_extend(0, static_cast<const uint8_t *>(data), size);
+    }
+
+    // Appends frames to out. Records are encoded straight into a batch buffer and checksummed there,
+    // the batch goes to out in one write once it holds batch_size bytes, on flush() or in the
+    // destructor. Records of 4 GiB or more don't fit the size field, append returns false for them
+    // and writes nothing.
+    struct record_log_writer
+    {
+        explicit record_log_writer(writer &out, size_t batch_size = 256 * 1024)
+            : _parent(out)
+            , _batch_size(batch_size)
+        {
+            _batch.reserve(batch_size);
+        }
+
+        record_log_writer(const record_log_writer &) = delete;
+        record_log_writer &operator=(const record_log_writer &) = delete;
+
+        ~record_log_writer()
+        {
+            flush();
+        }
+
+        template<class T>
+        bool append(const T &value)
+        {
+            size_t start = begin_frame();
+
+            string_writer batch_out(_batch);
+            serialize_to_writer(value, batch_out);
+
+            return end_frame(start);
+        }
+
+        bool append_raw(const void *data, size_t size)
+        {
+            if (size > UINT32_MAX) return false;
+
+            size_t start = begin_frame();
+            _batch.append(static_cast<const char *>(data), size);
+            return end_frame(start);
+        }
+
+        void flush()
+        {
+            if (_batch.empty()) return;
+
+            _parent.write(_batch.data(), _batch.size());
+            _batch.clear();
+        }
+
+    private:
+        size_t begin_frame()
+        {
+            size_t start = _batch.size();
+            _batch.resize(start + detail::record_frame_header_size);
+            return start;
+        }
+
+        bool end_frame(size_t start)
+        {
+            size_t size = _batch.size() - start - detail::record_frame_header_size;
+            if (size > UINT32_MAX)
+            {
+                _batch.resize(start);
+                return false;
+            }
+
+            auto header = reinterpret_cast<uint8_t *>(&_batch[start]);
+            auto payload = header + detail::record_frame_header_size;
+
+            detail::store_le32(header, detail::record_frame_magic);
+            detail::store_le32(header + 4, static_cast<uint32_t>(size));
+            detail::store_le32(header + 8, detail::masked_crc32c(header, 8));
+            detail::store_le32(header + 12, detail::masked_crc32c(payload, size));
+
+            if (_batch.size() >= _batch_size) flush();
+            return true;
+        }
+
+        writer &_parent;
+        size_t _batch_size;
+        std::string _batch;
+    };
+
+    // Reads frames written by record_log_writer from in, checking both checksums. A damaged frame is
+    // skipped: after a bad header the reader searches for the next magic, after a bad payload it
+    // continues behind it. A frame cut off by the end of the input counts as damaged too. Anyone can
+    // compute the header checksum, so a size above max_record_size or beyond the end of an input of
+    // known size is taken for a damaged header before anything is allocated for it.
+    struct record_log_reader
+    {
+        explicit record_log_reader(reader &in, size_t buffer_size = 256 * 1024, size_t max_record_size = 64 * 1024 * 1024)
+            : _parent(in)
+            , _buffer_size(std::max(buffer_size, detail::record_frame_header_size))
+            , _max_record_size(max_record_size)
+        {}
+
+        record_log_reader(const record_log_reader &) = delete;
+        record_log_reader &operator=(const record_log_reader &) = delete;
+
+        // Next intact payload, it stays valid until the next call. False at the end of the input.
+        bool next_raw(const uint8_t *&data, size_t &size)
+        {
+            while (fill(detail::record_frame_header_size))
+            {
+                const uint8_t *header = _buffer.data() + _pos;
+                if (detail::load_le32(header) != detail::record_frame_magic || detail::load_le32(header + 8) != detail::masked_crc32c(header, 8))
+                {
+                    resync();
+                    continue;
+                }
+
+                size_t payload_size = detail::load_le32(header + 4);
+                size_t buffered = _end - _pos - detail::record_frame_header_size;
+                if (payload_size > _max_record_size
+                    || (payload_size > buffered && _parent.size_known() && payload_size - buffered > _parent.available_bytes()))
+                {
+                    resync();
+                    continue;
+                }
+
+                if (!fill(detail::record_frame_header_size + payload_size))
+                {
+                    ++_corrupt_frames;
+                    _skipped_bytes += _end - _pos;
+                    _pos = _end;
+                    break;
+                }
+
+                // fill() may have moved the buffer
+                header = _buffer.data() + _pos;
+                const uint8_t *payload = header + detail::record_frame_header_size;
+                _pos += detail::record_frame_header_size + payload_size;
+
+                if (detail::load_le32(header + 12) != detail::masked_crc32c(payload, payload_size))
+                {
+                    ++_corrupt_frames;
+                    _skipped_bytes += detail::record_frame_header_size + payload_size;
+                    continue;
+                }
+
+                data = payload;
+                size = payload_size;
+                return true;
+            }
+
+            _skipped_bytes += _end - _pos;
+            _pos = _end;
+            _finished = true;
+            return false;
+        }
+
+        // False at the end of the input, or when an intact record doesn't parse as T (finished() is
+        // false then and the next call continues with the following record)
+        template<class T>
+        bool next(T &value)
+        {
+            const uint8_t *data;
+            size_t size;
+            if (!next_raw(data, size)) return false;
+
+            buffer_reader buffer_in(data, size);
+            return parse_from_reader(value, buffer_in);
+        }
+
+        bool finished() const
+        {
+            return _finished;
+        }
+
+        // Frames dropped for a bad checksum, an impossible size or truncation
+        uint64_t corrupt_frames() const
+        {
+            return _corrupt_frames;
+        }
+
+        // Bytes that were not part of an intact frame
+        uint64_t skipped_bytes() const
+        {
+            return _skipped_bytes;
+        }
+
+    private:
+        // At least size unread bytes in the buffer, false when the input ends before
+        bool fill(size_t size)
+        {
+            if (_end - _pos >= size) return true;
+            if (_input_end) return false;
+
+            if (_pos > 0)
+            {
+                std::memmove(_buffer.data(), _buffer.data() + _pos, _end - _pos);
+                _end -= _pos;
+                _pos = 0;
+            }
+
+            if (_buffer.size() < std::max(size, _buffer_size))
+            {
+                _buffer.resize(std::max(size, _buffer_size));
+            }
+
+            while (_end < size)
+            {
+                size_t read_size = _parent.read(_buffer.data() + _end, _buffer.size() - _end);
+                _end += read_size;
+                if (read_size == 0)
+                {
+                    _input_end = true;
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        // Drops bytes up to the next possible frame start
+        void resync()
+        {
+            ++_corrupt_frames;
+
+            const uint8_t magic[4] = {0x50, 0x55, 0x47, 0x31};
+            size_t from = _pos + 1;
+            for (;;)
+            {
+                auto data = _buffer.data();
+                auto found = std::search(data + from, data + _end, magic, magic + sizeof(magic));
+
+                // A magic cut off by the end of the buffer has to stay
+                size_t next = found != data + _end ? static_cast<size_t>(found - data)
+                              : std::max(from, _end - std::min<size_t>(_end, sizeof(magic) - 1));
+
+                _skipped_bytes += next - _pos;
+                _pos = next;
+
+                if (found != data + _end || !fill(_end - _pos + 1)) return;
+                from = _pos;
+            }
+        }
+
+        reader &_parent;
+        size_t _buffer_size;
+        size_t _max_record_size;
+        std::vector<uint8_t> _buffer;
+        size_t _pos = 0;
+        size_t _end = 0;
+        bool _input_end = false;
+        bool _finished = false;
+        uint64_t _corrupt_frames = 0;
+        uint64_t _skipped_bytes = 0;
+    };
+}
@@ -0,0 +1,513 @@
+#pragma once
+
+// Scans a stream of delimited messages (see serialize_delimited_to_writer) and decodes only the
+// records whose fields pass a scan_filter. Conditions are checked on the encoded record, records
+// that fail them are skipped by their length prefix without being parsed.
+
+#include "protopug.h"
+
+#include <algorithm>
+#include <deque>
+#include <initializer_list>
+#include <string_view>
+#include <type_traits>
+
+namespace protopug
+{
+    namespace detail
+    {
+        template<class Field, class Member = typename Field::member_type>
+        struct scan_field_traits
+        {
+            using type = Member;
+            // An absent field compares as its default value
+            constexpr static const bool has_default = true;
+        };
+
+        template<class Field, class Value>
+        struct scan_field_traits<Field, std::optional<Value>>
+        {
+            using type = Value;
+            constexpr static const bool has_default = false;
+        };
+
+        template<class Field, class... Alternatives>
+        struct scan_field_traits<Field, std::variant<Alternatives...>>
+        {
+            using type = std::variant_alternative_t<Field::index, std::variant<Alternatives...>>;
+            constexpr static const bool has_default = false;
+        };
+
+        // The variant member a oneof alternative shares with its siblings, void for other fields
+        template<class Field>
+        struct scan_oneof_member
+        {
+            using type = void;
+        };
+
+        template<uint32_t Tag, size_t Index, class MemPtrT, MemPtrT MemPtr, uint32_t Flags>
+        struct scan_oneof_member<oneof_field_impl<Tag, Index, MemPtrT, MemPtr, Flags>>
+        {
+            using type = std::integral_constant<MemPtrT, MemPtr>;
+        };
+
+        // Tags of the other alternatives of Field's oneof in the flat Message
+        template<class Field, class Message>
+        struct scan_oneof_siblings;
+
+        template<class Field, class... Fields>
+        struct scan_oneof_siblings<Field, message_impl<Fields...>>
+        {
+            using member = typename scan_oneof_member<Field>::type;
+
+            template<class Other>
+            static void add(std::vector<uint32_t> &tags)
+            {
+                if constexpr(!std::is_void_v<member> && std::is_same_v<typename scan_oneof_member<Other>::type, member>)
+                {
+                    if (Other::tag != Field::tag) tags.push_back(Other::tag);
+                }
+            }
+
+            static std::vector<uint32_t> tags()
+            {
+                std::vector<uint32_t> tags;
+                (add<Fields>(tags), ...);
+                return tags;
+            }
+        };
+
+        enum class scan_kind : uint8_t
+        {
+            signed_number,
+            unsigned_number,
+            floating_number,
+            bytes,
+        };
+
+        struct scan_value
+        {
+            int64_t signed_number = 0;
+            uint64_t unsigned_number = 0;
+            double floating_number = 0;
+            std::string_view bytes;
+        };
+
+        template<class T>
+        constexpr scan_kind scan_kind_of()
+        {
+            if constexpr(std::is_same_v<T, std::string>)
+            {
+                return scan_kind::bytes;
+            }
+            else if constexpr(std::is_floating_point_v<T>)
+            {
+                return scan_kind::floating_number;
+            }
+            else if constexpr(std::is_unsigned_v<T> || std::is_same_v<T, bool>)
+            {
+                return scan_kind::unsigned_number;
+            }
+            else
+            {
+                static_assert(std::is_integral_v<T> || std::is_enum_v<T>, "Only scalar and string fields can be scanned");
+                return scan_kind::signed_number;
+            }
+        }
+
+        // Decodes a record the way serializer<T> would, false on a wire type that doesn't fit the field
+        template<class T, uint32_t Flags>
+        bool decode_scan_value(const wire_record &record, scan_value &value)
+        {
+            if constexpr(std::is_same_v<T, std::string>)
+            {
+                if (record.wire_type != WireType::LengthDelimeted) return false;
+
+                value.bytes = std::string_view(reinterpret_cast<const char *>(record.data), record.size);
+            }
+            else if constexpr(std::is_floating_point_v<T>)
+            {
+                if (record.wire_type != (sizeof(T) == 8 ? WireType::Fixed64 : WireType::Fixed32)) return false;
+
+                if constexpr(sizeof(T) == 8)
+                {
+                    std::memcpy(&value.floating_number, &record.value, sizeof(double));
+                }
+                else
+                {
+                    uint32_t bits = static_cast<uint32_t>(record.value);
+                    float number;
+                    std::memcpy(&number, &bits, sizeof(number));
+                    value.floating_number = number;
+                }
+            }
+            else if constexpr(Flags & flags::f)
+            {
+                if (record.wire_type != (sizeof(T) == 8 ? WireType::Fixed64 : WireType::Fixed32)) return false;
+
+                if constexpr(std::is_signed_v<T>)
+                {
+                    value.signed_number = sizeof(T) == 8 ? static_cast<int64_t>(record.value) : static_cast<int32_t>(record.value);
+                }
+                else
+                {
+                    value.unsigned_number = record.value;
+                }
+            }
+            else
+            {
+                if (record.wire_type != WireType::Varint) return false;
+
+                if constexpr(std::is_same_v<T, bool>)
+                {
+                    value.unsigned_number = record.value != 0;
+                }
+                else if constexpr(std::is_unsigned_v<T>)
+                {
+                    value.unsigned_number = sizeof(T) == 8 ? record.value : static_cast<uint32_t>(record.value);
+                }
+                else if constexpr((Flags & flags::s) && sizeof(T) == 8)
+                {
+                    value.signed_number = read_zigzag_value(record.value);
+                }
+                else if constexpr(Flags & flags::s)
+                {
+                    value.signed_number = read_zigzag_value(static_cast<uint32_t>(record.value));
+                }
+                else
+                {
+                    value.signed_number = sizeof(T) == 8 ? static_cast<int64_t>(record.value) : static_cast<int32_t>(record.value);
+                }
+            }
+
+            return true;
+        }
+
+        template<class T>
+        void make_scan_value(const T &from, scan_value &value)
+        {
+            if constexpr(std::is_same_v<T, std::string>)
+            {
+                value.bytes = from;
+            }
+            else if constexpr(std::is_floating_point_v<T>)
+            {
+                value.floating_number = from;
+            }
+            else if constexpr(std::is_unsigned_v<T> || std::is_same_v<T, bool>)
+            {
+                value.unsigned_number = from;
+            }
+            else
+            {
+                value.signed_number = static_cast<int64_t>(from);
+            }
+        }
+
+        // -1, 0 or 1
+        int compare_scan_values(scan_kind kind, const scan_value &a, const scan_value &b)
+        {
+            switch (kind)
+            {
+            case scan_kind::signed_number:
+                return a.signed_number < b.signed_number ? -1 : a.signed_number > b.signed_number;
+            case scan_kind::unsigned_number:
+                return a.unsigned_number < b.unsigned_number ? -1 : a.unsigned_number > b.unsigned_number;
+            case scan_kind::floating_number:
+                return a.floating_number < b.floating_number ? -1 : a.floating_number > b.floating_number;
+            case scan_kind::bytes:
+            {
+                int result = a.bytes.compare(b.bytes);
+                return (result > 0) - (result < 0);
+            }
+            }
+
+            return 0;
+        }
+
+        enum class scan_operation : uint8_t
+        {
+            one_of,
+            in_range,
+            prefix,
+        };
+
+        struct scan_condition
+        {
+            uint32_t tag;
+            scan_kind kind;
+            scan_operation operation;
+            bool has_default;
+            // Other alternatives of a oneof field, a later one of them clears the field
+            std::vector<uint32_t> siblings;
+            bool (*decode)(const wire_record &record, scan_value &value);
+
+            // one_of: sorted values, in_range: min and max, prefix: the prefix
+            std::vector<scan_value> values;
+            // Backing storage of string values, deque elements stay put when it grows or is moved
+            std::deque<std::string> strings;
+
+            bool cleared_by(uint32_t record_tag) const
+            {
+                return !siblings.empty() && std::find(siblings.begin(), siblings.end(), record_tag) != siblings.end();
+            }
+
+            bool matches(const scan_value &value) const
+            {
+                switch (operation)
+                {
+                case scan_operation::one_of:
+                    return std::binary_search(values.begin(), values.end(), value, [&](const scan_value & a, const scan_value & b)
+                    {
+                        return compare_scan_values(kind, a, b) < 0;
+                    });
+                case scan_operation::in_range:
+                    return compare_scan_values(kind, values[0], value) <= 0 && compare_scan_values(kind, value, values[1]) <= 0;
+                case scan_operation::prefix:
+                    return value.bytes.substr(0, values[0].bytes.size()) == values[0].bytes;
+                }
+
+                return false;
+            }
+        };
+    }
+
+    // Conditions on singular scalar and string fields of T, all of which have to hold. A field that
+    // occurs several times is judged by its last occurrence, like the parser does. An absent field
+    // compares as its default value, an absent optional or oneof field never matches. A oneof field
+    // followed by another alternative of its oneof is absent, the parser keeps the later one.
+    template<class T>
+    struct scan_filter
+    {
+        template<uint32_t Tag, class V>
+        scan_filter &equals(const V &value)
+        {
+            return one_of<Tag, V>({value});
+        }
+
+        template<uint32_t Tag, class V>
+        scan_filter &one_of(std::initializer_list<V> values)
+        {
+            auto &condition = add<Tag>(detail::scan_operation::one_of);
+            for (const auto &value : values)
+            {
+                store<Tag>(condition, value);
+            }
+
+            std::sort(condition.values.begin(), condition.values.end(), [&](const detail::scan_value & a, const detail::scan_value & b)
+            {
+                return detail::compare_scan_values(condition.kind, a, b) < 0;
+            });
+            return *this;
+        }
+
+        // Both bounds inclusive
+        template<uint32_t Tag, class V>
+        scan_filter &in_range(const V &min, const V &max)
+        {
+            auto &condition = add<Tag>(detail::scan_operation::in_range);
+            store<Tag>(condition, min);
+            store<Tag>(condition, max);
+            return *this;
+        }
+
+        template<uint32_t Tag>
+        scan_filter &has_prefix(const std::string &prefix)
+        {
+            auto &condition = add<Tag>(detail::scan_operation::prefix);
+            static_assert(std::is_same_v<typename field_traits<Tag>::type, std::string>, "Prefixes apply to string fields");
+            store<Tag>(condition, prefix);
+            return *this;
+        }
+
+        // Checks the encoded message without decoding it, false for malformed input too
+        bool matches(const uint8_t *data, size_t size) const
+        {
+            // Last occurrence of the field of each condition, found in one pass over the message
+            constexpr size_t max_tracked = 16;
+            detail::wire_record last[max_tracked];
+            bool found[max_tracked] = {};
+            size_t tracked = std::min(_conditions.size(), max_tracked);
+
+            const uint8_t *pos = data;
+            const uint8_t *end = data + size;
+            while (pos != end)
+            {
+                detail::wire_record record;
+                if (!detail::read_record(record, pos, end)) return false;
+
+                for (size_t i = 0; i < tracked; ++i)
+                {
+                    if (_conditions[i].tag == record.tag)
+                    {
+                        last[i] = record;
+                        found[i] = true;
+                    }
+                    else if (_conditions[i].cleared_by(record.tag))
+                    {
+                        found[i] = false;
+                    }
+                }
+            }
+
+            for (size_t i = 0; i < _conditions.size(); ++i)
+            {
+                const detail::wire_record *record = nullptr;
+                detail::wire_record untracked;
+                if (i < max_tracked)
+                {
+                    record = found[i] ? &last[i] : nullptr;
+                }
+                else if (last_record(_conditions[i], data, size, untracked))
+                {
+                    record = &untracked;
+                }
+
+                if (!condition_matches(_conditions[i], record)) return false;
+            }
+
+            return true;
+        }
+
+    private:
+        template<uint32_t Tag>
+        struct field_traits
+        {
+            using message = std::decay_t<decltype(descriptor<T>::type())>;
+            using field_type = typename detail::message_field_with_tag<Tag, message>::type;
+            static_assert(!std::is_void_v<field_type>, "No field with this tag");
+
+            using type = typename detail::scan_field_traits<field_type>::type;
+            constexpr static const bool has_default = detail::scan_field_traits<field_type>::has_default;
+            constexpr static const uint32_t flags = field_type::flags;
+
+            static std::vector<uint32_t> siblings()
+            {
+                return detail::scan_oneof_siblings<field_type, detail::flat_message_t<message>>::tags();
+            }
+        };
+
+        template<uint32_t Tag>
+        detail::scan_condition &add(detail::scan_operation operation)
+        {
+            using traits = field_traits<Tag>;
+
+            detail::scan_condition condition;
+            condition.tag = Tag;
+            condition.kind = detail::scan_kind_of<typename traits::type>();
+            condition.operation = operation;
+            condition.has_default = traits::has_default;
+            condition.siblings = traits::siblings();
+            condition.decode = &detail::decode_scan_value<typename traits::type, traits::flags>;
+
+            _conditions.push_back(std::move(condition));
+            return _conditions.back();
+        }
+
+        template<uint32_t Tag, class V>
+        void store(detail::scan_condition &condition, const V &value)
+        {
+            using Type = typename field_traits<Tag>::type;
+
+            detail::scan_value scan_value;
+            if constexpr(std::is_same_v<Type, std::string>)
+            {
+                detail::make_scan_value(condition.strings.emplace_back(value), scan_value);
+            }
+            else
+            {
+                detail::make_scan_value(static_cast<Type>(value), scan_value);
+            }
+            condition.values.push_back(scan_value);
+        }
+
+        static bool condition_matches(const detail::scan_condition &condition, const detail::wire_record *record)
+        {
+            detail::scan_value value;
+            if (!record)
+            {
+                return condition.has_default && condition.matches(value);
+            }
+
+            return condition.decode(*record, value) && condition.matches(value);
+        }
+
+        static bool last_record(const detail::scan_condition &condition, const uint8_t *data, size_t size, detail::wire_record &last)
+        {
+            bool found = false;
+
+            const uint8_t *pos = data;
+            const uint8_t *end = data + size;
+            detail::wire_record record;
+            while (pos != end && detail::read_record(record, pos, end))
+            {
+                if (record.tag == condition.tag)
+                {
+                    last = record;
+                    found = true;
+                }
+                else if (condition.cleared_by(record.tag))
+                {
+                    found = false;
+                }
+            }
+
+            return found;
+        }
+
+        std::vector<detail::scan_condition> _conditions;
+    };
+
+    // Calls handler(T &) with every message of a delimited stream that passes filter. Returns false
+    // when the stream is malformed or truncated.
+    template<class T, class Handler>
+    bool scan_delimited(std::string_view in, const scan_filter<T> &filter, Handler &&handler)
+    {
+        auto pos = reinterpret_cast<const uint8_t *>(in.data());
+        auto end = pos + in.size();
+
+        while (pos != end)
+        {
+            uint64_t size;
+            if (!detail::read_varint(size, pos, end) || size > static_cast<size_t>(end - pos)) return false;
+
+            const uint8_t *data = pos;
+            pos += size;
+
+            if (!filter.matches(data, size)) continue;
+
+            T value {};
+            buffer_reader buffer_in(data, size);
+            if (!detail::read_message(value, message_type<T>(), buffer_in)) return false;
+
+            handler(value);
+        }
+
+        return true;
+    }
+
+    // Same for a stream read from in, every record goes through one reused buffer
+    template<class T, class Handler>
+    bool scan_delimited(reader &in, const scan_filter<T> &filter, Handler &&handler)
+    {
+        std::string record;
+
+        uint64_t size;
+        bool end;
+        while (detail::read_size_prefix(size, end, in))
+        {
+            if (size > in.available_bytes() || !detail::read_string(record, size, in)) return false;
+
+            auto data = reinterpret_cast<const uint8_t *>(record.data());
+            if (!filter.matches(data, size)) continue;
+
+            T value {};
+            buffer_reader buffer_in(data, size);
+            if (!detail::read_message(value, message_type<T>(), buffer_in)) return false;
+
+            handler(value);
+        }
+
+        return end;
+    }
+}
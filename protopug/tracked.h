@@ -0,0 +1,173 @@
+#pragma once
+
+// Message wrapper that keeps the encoding of every field from the last serialization and only
+// re-encodes the fields that were changed since. Meant for large, mostly unchanged objects that
+// are serialized again after touching a few fields. Nested tracked_message members are cached the
+// same way, so changing a deep field re-encodes that field and copies the rest.
+
+#include "protopug.h"
+
+#include <array>
+#include <type_traits>
+
+namespace protopug
+{
+    template<class T>
+    class tracked_message
+    {
+        using message_type_t = std::decay_t<decltype(message_type<T>())>;
+        constexpr static const size_t field_count = detail::message_field_count<message_type_t>::value;
+
+    public:
+        tracked_message() = default;
+
+        explicit tracked_message(T value)
+            : _value(std::move(value))
+        {
+        }
+
+        const T &get() const
+        {
+            return _value;
+        }
+
+        const T *operator->() const
+        {
+            return &_value;
+        }
+
+        // Access to the member of the field with Tag for modification. The field is re-encoded by the
+        // next serialization; oneof fields sharing the member are marked too. The reference is only
+        // good until then: once serialize() or byte_size() ran, writes through it are not seen and
+        // mutate() has to be called again.
+        template<uint32_t Tag>
+        auto &mutate()
+        {
+            using Field = typename detail::message_field_with_tag<Tag, message_type_t>::type;
+            static_assert(!std::is_void_v<Field>, "No field with this tag");
+
+            auto &member = Field::get(_value);
+            mark_dirty(&member);
+            return member;
+        }
+
+        // Access to the whole value, everything is re-encoded by the next serialization
+        T &mutate_all()
+        {
+            _dirty.fill(true);
+            return _value;
+        }
+
+        size_t byte_size() const
+        {
+            refresh();
+            return _byte_size;
+        }
+
+        void serialize(writer &out) const
+        {
+            refresh();
+            for (const auto &segment : _segments)
+            {
+                if (!segment.empty()) out.write(segment.data(), segment.size());
+            }
+        }
+
+    private:
+        void mark_dirty(const void *member)
+        {
+            size_t i = 0;
+            message_type<T>().visit([&](const auto & field)
+            {
+                using Field = std::decay_t<decltype(field)>;
+                if (static_cast<const void *>(&Field::get(_value)) == member) _dirty[i] = true;
+                ++i;
+            });
+        }
+
+        // Serialization doesn't change the value, only the cache; it is not safe to serialize the
+        // same object from several threads at once
+        void refresh() const
+        {
+            size_t i = 0;
+            message_type<T>().visit([&](const auto & field)
+            {
+                if (_dirty[i])
+                {
+                    std::string &segment = _segments[i];
+                    _byte_size -= segment.size();
+
+                    segment.clear();
+                    string_writer segment_out(segment);
+                    detail::write_field(_value, field, segment_out);
+
+                    _byte_size += segment.size();
+                    _dirty[i] = false;
+                }
+                ++i;
+            });
+        }
+
+        T _value {};
+
+        mutable std::array<std::string, field_count> _segments;
+        mutable std::array<bool, field_count> _dirty = make_all_dirty();
+        mutable size_t _byte_size = 0;
+
+        static constexpr std::array<bool, field_count> make_all_dirty()
+        {
+            std::array<bool, field_count> dirty {};
+            for (auto &item : dirty)
+            {
+                item = true;
+            }
+            return dirty;
+        }
+    };
+
+    // A tracked_message member of another message, its cached encoding is copied when the parent
+    // field is re-encoded
+    template<class T>
+    struct serializer<tracked_message<T>>
+    {
+        static void serialize(uint32_t tag, const tracked_message<T> &value, flags_t<>, writer &out, bool force = false)
+        {
+            size_t size = value.byte_size();
+            if (!force && size == 0) return;
+
+            detail::write_tag_wire_type(tag, WireType::LengthDelimeted, out);
+            detail::write_varint(size, out);
+            value.serialize(out);
+        }
+
+        static bool parse(WireType wire_type, tracked_message<T> &value, flags_t<>, reader &in)
+        {
+            return serializer<T>::parse(wire_type, value.mutate_all(), flags_t<>(), in);
+        }
+    };
+
+    template <class T>
+    void serialize_to_writer(const tracked_message<T> &value, writer &out)
+    {
+        value.serialize(out);
+    }
+
+    template <class T>
+    void serialize_to_string(const tracked_message<T> &value, std::string &out)
+    {
+        string_writer string_out(out);
+        value.serialize(string_out);
+    }
+
+    template <class T>
+    bool parse_from_reader(tracked_message<T> &value, reader &in)
+    {
+        return parse_from_reader(value.mutate_all(), in);
+    }
+
+    template <class T>
+    bool parse_from_string(tracked_message<T> &value, const std::string &in)
+    {
+        return parse_from_string(value.mutate_all(), in);
+    }
+}
@@ -0,0 +1,298 @@
+#pragma once
+
+// Validation of encoded messages against their descriptor without decoding them
+
+#include "protopug.h"
+
+#include <string_view>
+#include <type_traits>
+
+namespace protopug
+{
+    struct validate_options
+    {
+        size_t max_depth = 100;
+    };
+
+    namespace detail
+    {
+        struct validate_context
+        {
+            const validate_options &options;
+            const uint8_t *error = nullptr;
+            size_t depth = 0;
+        };
+
+        template<class T>
+        bool validate_message(const uint8_t *pos, const uint8_t *end, validate_context &context);
+
+        template<class T>
+        constexpr bool is_scalar_v = std::is_arithmetic_v<T> || std::is_enum_v<T>;
+
+        template<class T, uint32_t Flags>
+        constexpr WireType scalar_wire_type()
+        {
+            if constexpr(std::is_floating_point_v<T> || (Flags & flags::f))
+            {
+                return sizeof(T) == 8 ? WireType::Fixed64 : WireType::Fixed32;
+            }
+            else
+            {
+                return WireType::Varint;
+            }
+        }
+
+        bool validate_varint(const uint8_t *&pos, const uint8_t *end, size_t max_size)
+        {
+            for (size_t i = 0; i < max_size && pos != end; ++i)
+            {
+                if (!(*pos++ & 0b1000'0000))
+                    return true;
+            }
+            return false;
+        }
+
+        bool validate_length_delimited(const uint8_t *&pos, const uint8_t *end, const uint8_t *&data, size_t &size)
+        {
+            uint64_t length;
+            if (!read_varint(length, pos, end) || length > static_cast<size_t>(end - pos))
+                return false;
+
+            data = pos;
+            size = length;
+            pos += length;
+            return true;
+        }
+
+        bool validate_unknown(WireType wire_type, const uint8_t *&pos, const uint8_t *end)
+        {
+            const uint8_t *data;
+            size_t size;
+
+            switch (wire_type)
+            {
+            case WireType::Varint:
+                return validate_varint(pos, end, 10);
+            case WireType::Fixed64:
+            case WireType::Fixed32:
+                size = wire_type == WireType::Fixed64 ? 8 : 4;
+                if (static_cast<size_t>(end - pos) < size) return false;
+                pos += size;
+                return true;
+            case WireType::LengthDelimeted:
+                return validate_length_delimited(pos, end, data, size);
+            default:
+                return false;
+            }
+        }
+
+        // One value of type T whose tag key has already been consumed
+        template<class T, uint32_t Flags>
+        bool validate_value(WireType wire_type, const uint8_t *&pos, const uint8_t *end, validate_context &context)
+        {
+            if constexpr(is_scalar_v<T>)
+            {
+                constexpr WireType expected = scalar_wire_type<T, Flags>();
+                if (wire_type != expected) return false;
+
+                if constexpr(expected == WireType::Varint)
+                {
+                    // read_varint(uint32_t &) stops after 5 bytes
+                    return validate_varint(pos, end, sizeof(T) == 8 ? 10 : 5);
+                }
+                else
+                {
+                    if (static_cast<size_t>(end - pos) < sizeof(T)) return false;
+                    pos += sizeof(T);
+                    return true;
+                }
+            }
+            else
+            {
+                const uint8_t *data;
+                size_t size;
+                if (wire_type != WireType::LengthDelimeted || !validate_length_delimited(pos, end, data, size)) return false;
+
+                if constexpr(is_bytes<T>::value)
+                {
+                    // Only fields declared with flags::utf8 are text, like in the parser
+                    return !(Flags & flags::utf8) || is_valid_utf8(data, size);
+                }
+                else
+                {
+                    if (context.depth >= context.options.max_depth) return false;
+
+                    ++context.depth;
+                    bool result = validate_message<T>(data, data + size, context);
+                    --context.depth;
+                    return result;
+                }
+            }
+        }
+
+        template<class T, uint32_t Flags>
+        bool validate_member(WireType wire_type, const uint8_t *&pos, const uint8_t *end, validate_context &context)
+        {
+            if constexpr(is_specialization_of<T, std::vector>::value)
+            {
+                using Element = typename T::value_type;
+                if constexpr(is_scalar_v<Element>)
+                {
+                    // Packable fields are only accepted packed
+                    const uint8_t *data;
+                    size_t size;
+                    if (wire_type != WireType::LengthDelimeted || !validate_length_delimited(pos, end, data, size)) return false;
+
+                    const uint8_t *data_end = data + size;
+                    while (data != data_end)
+                    {
+                        if (!validate_value<Element, Flags>(scalar_wire_type<Element, Flags>(), data, data_end, context)) return false;
+                    }
+                    return true;
+                }
+                else
+                {
+                    return validate_value<Element, Flags>(wire_type, pos, end, context);
+                }
+            }
+            else if constexpr(is_specialization_of<T, std::optional>::value)
+            {
+                return validate_value<typename T::value_type, Flags>(wire_type, pos, end, context);
+            }
+            else
+            {
+                return validate_value<T, Flags>(wire_type, pos, end, context);
+            }
+        }
+
+        template<class Key, class Value, uint32_t KeyFlags, uint32_t ValueFlags>
+        bool validate_map_entry(WireType wire_type, const uint8_t *&pos, const uint8_t *end, validate_context &context)
+        {
+            const uint8_t *data;
+            size_t size;
+            if (wire_type != WireType::LengthDelimeted || !validate_length_delimited(pos, end, data, size)) return false;
+
+            const uint8_t *data_end = data + size;
+            while (data != data_end)
+            {
+                const uint8_t *record_begin = data;
+
+                uint64_t tag_key;
+                if (!read_varint(tag_key, data, data_end) || tag_key > UINT32_MAX) return false;
+
+                uint32_t tag;
+                WireType entry_wire_type;
+                read_tag_wire_type(static_cast<uint32_t>(tag_key), tag, entry_wire_type);
+
+                bool result;
+                switch (tag)
+                {
+                case 1:
+                    result = validate_value<Key, KeyFlags>(entry_wire_type, data, data_end, context);
+                    break;
+                case 2:
+                    result = validate_member<Value, ValueFlags>(entry_wire_type, data, data_end, context);
+                    break;
+                default:
+                    result = validate_unknown(entry_wire_type, data, data_end);
+                    break;
+                }
+
+                if (!result)
+                {
+                    if (!context.error) context.error = record_begin;
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        template<uint32_t Tag, class MemPtrT, MemPtrT MemPtr, uint32_t Flags>
+        bool validate_field(const field_impl<Tag, MemPtrT, MemPtr, Flags> &/*field*/, WireType wire_type, const uint8_t *&pos, const uint8_t *end,
+                            validate_context &context)
+        {
+            using Field = field_impl<Tag, MemPtrT, MemPtr, Flags>;
+            return validate_member<typename Field::member_type, Flags>(wire_type, pos, end, context);
+        }
+
+        template<uint32_t Tag, size_t Index, class MemPtrT, MemPtrT MemPtr, uint32_t Flags>
+        bool validate_field(const oneof_field_impl<Tag, Index, MemPtrT, MemPtr, Flags> &/*field*/, WireType wire_type, const uint8_t *&pos,
+                            const uint8_t *end, validate_context &context)
+        {
+            using OneOf = oneof_field_impl<Tag, Index, MemPtrT, MemPtr, Flags>;
+            return validate_value<std::variant_alternative_t<Index, typename OneOf::member_type>, Flags>(wire_type, pos, end, context);
+        }
+
+        template<uint32_t Tag, class MemPtrT, MemPtrT MemPtr, uint32_t KeyFlags, uint32_t ValueFlags>
+        bool validate_field(const map_field_impl<Tag, MemPtrT, MemPtr, KeyFlags, ValueFlags> &/*field*/, WireType wire_type, const uint8_t *&pos,
+                            const uint8_t *end, validate_context &context)
+        {
+            using Map = typename map_field_impl<Tag, MemPtrT, MemPtr, KeyFlags, ValueFlags>::member_type;
+            return validate_map_entry<typename Map::key_type, typename Map::mapped_type, KeyFlags, ValueFlags>(wire_type, pos, end, context);
+        }
+
+        template<class T>
+        bool validate_record(const uint8_t *&pos, const uint8_t *end, validate_context &context)
+        {
+            uint64_t tag_key;
+            if (!read_varint(tag_key, pos, end) || tag_key > UINT32_MAX) return false;
+
+            uint32_t tag;
+            WireType wire_type;
+            read_tag_wire_type(static_cast<uint32_t>(tag_key), tag, wire_type);
+            if (tag == 0) return false;
+
+            bool known = false;
+            bool result = false;
+            message_type<T>().visit_fields([&](const auto & field)
+            {
+                if (known || std::decay_t<decltype(field)>::tag != tag) return;
+
+                known = true;
+                result = validate_field(field, wire_type, pos, end, context);
+            });
+
+            return known ? result : validate_unknown(wire_type, pos, end);
+        }
+
+        template<class T>
+        bool validate_message(const uint8_t *pos, const uint8_t *end, validate_context &context)
+        {
+            while (pos != end)
+            {
+                const uint8_t *record_begin = pos;
+                if (!validate_record<T>(pos, end, context))
+                {
+                    if (!context.error) context.error = record_begin;
+                    return false;
+                }
+            }
+            return true;
+        }
+    }
+
+    // Checks that in is a well-formed T without materializing it: wire types match the descriptor,
+    // varints terminate, lengths stay inside their parent, nesting is at most max_depth deep and
+    // flags::utf8 strings are UTF-8. On failure error_position is the offset of the innermost bad
+    // record.
+    template<class T>
+    bool validate(std::string_view in, size_t &error_position, const validate_options &options = {})
+    {
+        auto begin = reinterpret_cast<const uint8_t *>(in.data());
+
+        detail::validate_context context {options};
+        if (detail::validate_message<T>(begin, begin + in.size(), context))
+            return true;
+
+        error_position = context.error - begin;
+        return false;
+    }
+
+    template<class T>
+    bool validate(std::string_view in, const validate_options &options = {})
+    {
+        size_t error_position;
+        return validate<T>(in, error_position, options);
+    }
+}
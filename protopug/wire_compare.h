@@ -0,0 +1,1027 @@
+#pragma once
+
+#include "protopug.h"
+
+#include <algorithm>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+namespace protopug
+{
+    namespace detail
+    {
+        std::string_view record_payload(const wire_record &record)
+        {
+            return std::string_view(reinterpret_cast<const char *>(record.data), record.size);
+        }
+
+        uint64_t hash_combine(uint64_t hash, uint64_t value)
+        {
+            value *= UINT64_C(0x9E3779B97F4A7C15);
+            value ^= value >> 29;
+            hash = (hash ^ value) * UINT64_C(0xBF58476D1CE4E5B9);
+            return hash ^ (hash >> 31);
+        }
+
+        uint64_t hash_bytes(const void *bytes, size_t size, uint64_t seed = 0)
+        {
+            // xxh64: four independent lanes per 32 byte stripe, which the compiler keeps in vector registers
+            constexpr uint64_t p1 = UINT64_C(0x9E3779B185EBCA87);
+            constexpr uint64_t p2 = UINT64_C(0xC2B2AE3D27D4EB4F);
+            constexpr uint64_t p3 = UINT64_C(0x165667B19E3779F9);
+            constexpr uint64_t p4 = UINT64_C(0x85EBCA77C2B2AE63);
+            constexpr uint64_t p5 = UINT64_C(0x27D4EB2F165667C5);
+
+            auto rotl = [](uint64_t x, int r)
+            {
+                return (x << r) | (x >> (64 - r));
+            };
+            auto round = [&](uint64_t acc, uint64_t input)
+            {
+                return rotl(acc + input * p2, 31) * p1;
+            };
+            auto load64 = [](const uint8_t *p)
+            {
+                uint64_t v;
+                std::memcpy(&v, p, sizeof(v));
+                return v;
+            };
+            auto load32 = [](const uint8_t *p)
+            {
+                uint32_t v;
+                std::memcpy(&v, p, sizeof(v));
+                return v;
+            };
+
+            auto p = reinterpret_cast<const uint8_t *>(bytes);
+            auto end = p + size;
+            uint64_t hash;
+
+            if (size >= 32)
+            {
+                uint64_t lanes[4] = {seed + p1 + p2, seed + p2, seed, seed - p1};
+                for (; end - p >= 32; p += 32)
+                {
+                    for (size_t i = 0; i < 4; ++i)
+                    {
+                        lanes[i] = round(lanes[i], load64(p + i * 8));
+                    }
+                }
+
+                hash = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18);
+                for (auto lane : lanes)
+                {
+                    hash = (hash ^ round(0, lane)) * p1 + p4;
+                }
+            }
+            else
+            {
+                hash = seed + p5;
+            }
+
+            hash += size;
+
+            for (; end - p >= 8; p += 8)
+            {
+                hash = rotl(hash ^ round(0, load64(p)), 27) * p1 + p4;
+            }
+            if (end - p >= 4)
+            {
+                hash = rotl(hash ^ (load32(p) * p1), 23) * p2 + p3;
+                p += 4;
+            }
+            for (; p != end; ++p)
+            {
+                hash = rotl(hash ^ (*p * p5), 11) * p1;
+            }
+
+            hash ^= hash >> 33;
+            hash *= p2;
+            hash ^= hash >> 29;
+            hash *= p3;
+            hash ^= hash >> 32;
+            return hash;
+        }
+
+        // A field as the wire comparison sees it: its tag, the model that turns its records into
+        // state, and for oneof alternatives the member they share
+        template<uint32_t Tag, class Model, class OneOfMember = void>
+        struct wire_field
+        {
+            constexpr static const uint32_t tag = Tag;
+            using model = Model;
+            using oneof_member = OneOfMember;
+        };
+
+        template<class... Fields>
+        struct wire_fields;
+
+        template<class Field>
+        struct wire_field_traits;
+
+        template<class Message>
+        struct wire_fields_of_message;
+
+        template<class... Fields>
+        struct wire_fields_of_message<message_impl<Fields...>>
+        {
+            using type = wire_fields<typename wire_field_traits<Fields>::type...>;
+        };
+
+        // Fields of descriptor<T>, oneof groups flattened
+        template<class T>
+        using wire_message_fields = typename wire_fields_of_message<flat_message_t<std::decay_t<decltype(message_type<T>())>>>::type;
+
+        // Writes a message field from the state of its records, the size is computed once per state
+        template<class Fields>
+        bool write_canonical_fields(uint32_t tag, const typename Fields::state &state, writer &out, bool force)
+        {
+            size_t size;
+            if (!Fields::canonical_size(state, size)) return false;
+
+            if (!force && size == 0) return true;
+
+            write_tag_wire_type(tag, WireType::LengthDelimeted, out);
+            write_varint(size, out);
+
+            // A size pass of the enclosing message doesn't need the body written again
+            if (out.size_only)
+            {
+                out.write(nullptr, size);
+                return true;
+            }
+
+            return Fields::canonicalize(state, out);
+        }
+
+        // Value models describe how one value of a C++ type looks on the wire. Scalars are kept as
+        // their canonical 32/64 bit representation, so that varints of different lengths and -0.0
+        // compare the same way the parsed values would.
+        template<class T, uint32_t Flags>
+        struct wire_scalar_model
+        {
+            using repr_type = std::conditional_t<sizeof(T) == 8, uint64_t, uint32_t>;
+            using key_type = typename std::conditional_t<std::is_enum_v<T>, std::underlying_type<T>, std::common_type<T>>::type;
+            using value_type = uint64_t;
+
+            constexpr static const WireType wire_type = std::is_floating_point_v<T> || (Flags & flags::f)
+                    ? (sizeof(T) == 8 ? WireType::Fixed64 : WireType::Fixed32)
+                    : WireType::Varint;
+            constexpr static const bool packable = true;
+
+            static uint64_t normalize(uint64_t value)
+            {
+                if constexpr(std::is_same_v<T, bool>)
+                {
+                    return value != 0;
+                }
+                else if constexpr(std::is_floating_point_v<T>)
+                {
+                    constexpr uint64_t sign = UINT64_C(1) << (sizeof(T) * 8 - 1);
+                    value = static_cast<repr_type>(value);
+                    return (value & ~sign) == 0 ? 0 : value;
+                }
+                else
+                {
+                    return static_cast<repr_type>(value);
+                }
+            }
+
+            static bool read(const wire_record &record, value_type &value)
+            {
+                if (record.wire_type != wire_type) return false;
+
+                value = normalize(record.value);
+                return true;
+            }
+
+            static bool read_packed(value_type &value, const uint8_t *&pos, const uint8_t *end)
+            {
+                if constexpr(wire_type == WireType::Varint)
+                {
+                    if (!read_varint(value, pos, end)) return false;
+                }
+                else
+                {
+                    if (static_cast<size_t>(end - pos) < sizeof(repr_type)) return false;
+
+                    repr_type fixed;
+                    std::memcpy(&fixed, pos, sizeof(fixed));
+                    pos += sizeof(fixed);
+                    value = fixed;
+                }
+
+                value = normalize(value);
+                return true;
+            }
+
+            static bool equal_values(value_type a, value_type b)
+            {
+                return a == b;
+            }
+
+            static bool less(value_type a, value_type b)
+            {
+                return static_cast<key_type>(static_cast<repr_type>(a)) < static_cast<key_type>(static_cast<repr_type>(b));
+            }
+
+            static bool hash_value(value_type value, uint64_t &hash)
+            {
+                hash = value;
+                return true;
+            }
+
+            static size_t packed_size(value_type value)
+            {
+                return wire_type == WireType::Varint ? varint_size(value) : sizeof(repr_type);
+            }
+
+            static void write_packed(value_type value, writer &out)
+            {
+                if constexpr(wire_type == WireType::Varint)
+                {
+                    write_varint(static_cast<repr_type>(value), out);
+                }
+                else
+                {
+                    write_fixed(static_cast<repr_type>(value), out);
+                }
+            }
+
+            static bool write(uint32_t tag, value_type value, writer &out, bool force)
+            {
+                if (!force && value == 0) return true;
+
+                write_tag_wire_type(tag, wire_type, out);
+                write_packed(value, out);
+                return true;
+            }
+        };
+
+        struct wire_bytes_model
+        {
+            using value_type = std::string_view;
+
+            constexpr static const bool packable = false;
+
+            static bool read(const wire_record &record, value_type &value)
+            {
+                if (record.wire_type != WireType::LengthDelimeted) return false;
+
+                value = record_payload(record);
+                return true;
+            }
+
+            static bool equal_values(value_type a, value_type b)
+            {
+                return a == b;
+            }
+
+            static bool less(value_type a, value_type b)
+            {
+                return a < b;
+            }
+
+            static bool hash_value(value_type value, uint64_t &hash)
+            {
+                hash = value.empty() ? 0 : hash_bytes(value.data(), value.size());
+                return true;
+            }
+
+            static bool write(uint32_t tag, value_type value, writer &out, bool force)
+            {
+                if (!force && value.empty()) return true;
+
+                write_tag_wire_type(tag, WireType::LengthDelimeted, out);
+                write_varint(value.size(), out);
+                out.write(value.data(), value.size());
+                return true;
+            }
+        };
+
+
+        // Messages kept as their payload, which is walked when compared, hashed or written
+        template<class T>
+        struct wire_message_model
+        {
+            using value_type = std::string_view;
+
+            constexpr static const bool packable = false;
+
+            static bool read(const wire_record &record, value_type &value)
+            {
+                if (record.wire_type != WireType::LengthDelimeted) return false;
+
+                value = record_payload(record);
+                return true;
+            }
+
+            static bool walk(value_type value, typename wire_message_fields<T>::state &state)
+            {
+                auto begin = reinterpret_cast<const uint8_t *>(value.data());
+                return wire_message_fields<T>::walk(state, begin, begin + value.size());
+            }
+
+            static bool equal_values(value_type a, value_type b)
+            {
+                typename wire_message_fields<T>::state state_a, state_b;
+                return walk(a, state_a) && walk(b, state_b) && wire_message_fields<T>::equal(state_a, state_b);
+            }
+
+            static bool hash_value(value_type value, uint64_t &hash)
+            {
+                typename wire_message_fields<T>::state state;
+                hash = 0;
+                return walk(value, state) && wire_message_fields<T>::hash(state, hash);
+            }
+
+            static bool write(uint32_t tag, value_type value, writer &out, bool force)
+            {
+                typename wire_message_fields<T>::state state;
+                return walk(value, state) && write_canonical_fields<wire_message_fields<T>>(tag, state, out, force);
+            }
+        };
+
+        template<class T, uint32_t Flags, class Enable = void>
+        struct wire_value_model
+        {
+            using type = wire_message_model<T>;
+        };
+
+        template<class T, uint32_t Flags>
+        struct wire_value_model<T, Flags, std::enable_if_t<std::is_arithmetic_v<T> || std::is_enum_v<T>>>
+        {
+            using type = wire_scalar_model<T, Flags>;
+        };
+
+        template<class T, uint32_t Flags>
+        struct wire_value_model<T, Flags, std::enable_if_t<is_bytes<T>::value>>
+        {
+            using type = wire_bytes_model;
+        };
+
+        template<class T, uint32_t Flags>
+        using wire_value_model_t = typename wire_value_model<T, Flags>::type;
+
+        // Field models: the state that one pass over the records of a message leaves for a field,
+        // and how that state compares, hashes and is written. add() is called for every record of
+        // the field's tag, with the number of records of the message seen so far.
+
+        // Scalars and strings: the last occurrence wins
+        template<class Model>
+        struct wire_singular_field
+        {
+            struct state
+            {
+                typename Model::value_type value {};
+            };
+
+            static bool add(state &field, const wire_record &record, uint64_t /*ordinal*/)
+            {
+                Model::read(record, field.value);
+                return true;
+            }
+
+            static bool equal(const state &a, const state &b)
+            {
+                return Model::equal_values(a.value, b.value);
+            }
+
+            static bool hash(uint32_t tag, const state &field, uint64_t &hash)
+            {
+                uint64_t value_hash;
+                if (!Model::hash_value(field.value, value_hash)) return false;
+
+                if (value_hash != 0)
+                {
+                    hash = hash_combine(hash_combine(hash, tag), value_hash);
+                }
+                return true;
+            }
+
+            static bool canonicalize(uint32_t tag, const state &field, writer &out, bool force)
+            {
+                return Model::write(tag, field.value, out, force);
+            }
+        };
+
+        // Singular messages: all occurrences are merged into one state
+        template<class T>
+        struct wire_message_field
+        {
+            using state = typename wire_message_fields<T>::state;
+
+            static bool add(state &field, const wire_record &record, uint64_t /*ordinal*/)
+            {
+                if (record.wire_type != WireType::LengthDelimeted) return true;
+
+                return wire_message_fields<T>::walk(field, record.data, record.data + record.size);
+            }
+
+            static bool equal(const state &a, const state &b)
+            {
+                return wire_message_fields<T>::equal(a, b);
+            }
+
+            static bool hash(uint32_t tag, const state &field, uint64_t &hash)
+            {
+                uint64_t message_hash = 0;
+                if (!wire_message_fields<T>::hash(field, message_hash)) return false;
+
+                if (message_hash != 0)
+                {
+                    hash = hash_combine(hash_combine(hash, tag), message_hash);
+                }
+                return true;
+            }
+
+            static bool canonicalize(uint32_t tag, const state &field, writer &out, bool force)
+            {
+                return write_canonical_fields<wire_message_fields<T>>(tag, field, out, force);
+            }
+        };
+
+        // Optionals and oneof alternatives other than messages: only the last record counts, optional
+        // messages are re-created by every occurrence too. The ordinal tells which alternative of a
+        // oneof came last.
+        template<class Model>
+        struct wire_last_field
+        {
+            struct state
+            {
+                typename Model::value_type value {};
+                uint64_t ordinal = 0;
+            };
+
+            static bool add(state &field, const wire_record &record, uint64_t ordinal)
+            {
+                field.ordinal = ordinal;
+                if (!Model::read(record, field.value))
+                {
+                    field.value = typename Model::value_type();
+                }
+                return true;
+            }
+
+            static bool equal(const state &a, const state &b)
+            {
+                return Model::equal_values(a.value, b.value);
+            }
+
+            static bool hash(uint32_t tag, const state &field, uint64_t &hash)
+            {
+                return wire_singular_field<Model>::hash(tag, {field.value}, hash);
+            }
+
+            static bool canonicalize(uint32_t tag, const state &field, writer &out, bool force)
+            {
+                return Model::write(tag, field.value, out, force);
+            }
+        };
+
+        // Oneof alternatives that are messages: like parse_oneof, occurrences merge while the variant
+        // holds the alternative. wire_fields starts the state over when a sibling came in between.
+        template<class T>
+        struct wire_oneof_message_field
+        {
+            struct state
+            {
+                typename wire_message_fields<T>::state message;
+                uint64_t ordinal = 0;
+            };
+
+            static bool add(state &field, const wire_record &record, uint64_t ordinal)
+            {
+                field.ordinal = ordinal;
+                return wire_message_field<T>::add(field.message, record, ordinal);
+            }
+
+            static bool equal(const state &a, const state &b)
+            {
+                return wire_message_field<T>::equal(a.message, b.message);
+            }
+
+            static bool hash(uint32_t tag, const state &field, uint64_t &hash)
+            {
+                return wire_message_field<T>::hash(tag, field.message, hash);
+            }
+
+            static bool canonicalize(uint32_t tag, const state &field, writer &out, bool force)
+            {
+                return wire_message_field<T>::canonicalize(tag, field.message, out, force);
+            }
+        };
+
+        // Repeated fields: packed and unpacked occurrences form one sequence. The records are kept,
+        // sequences are compared element by element.
+        template<class Model>
+        struct wire_repeated_field
+        {
+            using value_type = typename Model::value_type;
+
+            struct state
+            {
+                size_t count = 0;
+                std::vector<wire_record> records;
+            };
+
+            static bool add(state &field, const wire_record &record, uint64_t /*ordinal*/)
+            {
+                bool known = true;
+                bool result = for_each_value(record, known, [&](value_type /*value*/)
+                {
+                    ++field.count;
+                    return true;
+                });
+
+                if (result && known)
+                {
+                    field.records.push_back(record);
+                }
+                return result;
+            }
+
+            static bool equal(const state &a, const state &b)
+            {
+                if (a.count != b.count) return false;
+
+                element_cursor cursor_a {a.records}, cursor_b {b.records};
+                value_type value_a, value_b;
+                while (cursor_a.next(value_a))
+                {
+                    cursor_b.next(value_b);
+                    if (!Model::equal_values(value_a, value_b)) return false;
+                }
+                return true;
+            }
+
+            static bool hash(uint32_t tag, const state &field, uint64_t &hash)
+            {
+                if (field.count == 0) return true;
+
+                uint64_t elements_hash = 0;
+                element_cursor cursor {field.records};
+                value_type value;
+                while (cursor.next(value))
+                {
+                    uint64_t value_hash;
+                    if (!Model::hash_value(value, value_hash)) return false;
+
+                    elements_hash = hash_combine(elements_hash, value_hash);
+                }
+
+                hash = hash_combine(hash_combine(hash_combine(hash, tag), elements_hash), field.count);
+                return true;
+            }
+
+            static bool canonicalize(uint32_t tag, const state &field, writer &out, bool /*force*/)
+            {
+                value_type value;
+                if constexpr(Model::packable)
+                {
+                    size_t size = 0;
+                    element_cursor size_cursor {field.records};
+                    while (size_cursor.next(value))
+                    {
+                        size += Model::packed_size(value);
+                    }
+
+                    if (size == 0) return true;
+
+                    write_tag_wire_type(tag, WireType::LengthDelimeted, out);
+                    write_varint(size, out);
+
+                    element_cursor cursor {field.records};
+                    while (cursor.next(value))
+                    {
+                        Model::write_packed(value, out);
+                    }
+                    return true;
+                }
+                else
+                {
+                    element_cursor cursor {field.records};
+                    while (cursor.next(value))
+                    {
+                        if (!Model::write(tag, value, out, false)) return false;
+                    }
+                    return true;
+                }
+            }
+
+        private:
+            // Elements of one record, known is false when the record has a wire type the field doesn't read
+            template<class Handler>
+            static bool for_each_value(const wire_record &record, bool &known, Handler &&handler)
+            {
+                value_type value;
+                known = true;
+
+                if constexpr(Model::packable)
+                {
+                    if (record.wire_type == WireType::LengthDelimeted)
+                    {
+                        const uint8_t *pos = record.data;
+                        const uint8_t *end = record.data + record.size;
+                        while (pos != end)
+                        {
+                            if (!Model::read_packed(value, pos, end) || !handler(value)) return false;
+                        }
+                        return true;
+                    }
+                }
+
+                if (!Model::read(record, value))
+                {
+                    known = false;
+                    return true;
+                }
+                return handler(value);
+            }
+
+            // Steps through the elements of the kept records, which add() has checked
+            struct element_cursor
+            {
+                const std::vector<wire_record> &records;
+                size_t index = 0;
+                const uint8_t *pos = nullptr;
+                const uint8_t *end = nullptr;
+
+                bool next(value_type &value)
+                {
+                    while (pos == end)
+                    {
+                        if (index == records.size()) return false;
+
+                        const auto &record = records[index++];
+                        if constexpr(Model::packable)
+                        {
+                            if (record.wire_type == WireType::LengthDelimeted)
+                            {
+                                pos = record.data;
+                                end = record.data + record.size;
+                                continue;
+                            }
+                        }
+
+                        Model::read(record, value);
+                        return true;
+                    }
+
+                    if constexpr(Model::packable)
+                    {
+                        Model::read_packed(value, pos, end);
+                    }
+                    return true;
+                }
+            };
+        };
+
+        template<class T, uint32_t Flags>
+        struct wire_field_model
+        {
+            using type = std::conditional_t<std::is_same_v<wire_value_model_t<T, Flags>, wire_message_model<T>>,
+                  wire_message_field<T>, wire_singular_field<wire_value_model_t<T, Flags>>>;
+        };
+
+        template<class T, uint32_t Flags>
+        struct wire_field_model<std::vector<T>, Flags>
+        {
+            using type = wire_repeated_field<wire_value_model_t<T, Flags>>;
+        };
+
+        template<class T, uint32_t Flags>
+        struct wire_field_model<std::optional<T>, Flags>
+        {
+            using type = wire_last_field<wire_value_model_t<T, Flags>>;
+        };
+
+        template<class T, uint32_t Flags>
+        using wire_field_model_t = typename wire_field_model<T, Flags>::type;
+
+        // Maps: the entries are kept and put into key order to be compared, hashed or written. The
+        // first entry of a key wins, like read_map inserts.
+        template<class Key, class Value, uint32_t KeyFlags, uint32_t ValueFlags>
+        struct wire_map_field
+        {
+            using key_model = wire_value_model_t<Key, KeyFlags>;
+            using key_field = wire_singular_field<key_model>;
+            using value_field = wire_field_model_t<Value, ValueFlags>;
+            using entry_fields = wire_fields<wire_field<1, key_field>, wire_field<2, value_field>>;
+
+            struct state
+            {
+                std::vector<std::string_view> entries;
+            };
+
+            static bool add(state &field, const wire_record &record, uint64_t /*ordinal*/)
+            {
+                if (record.wire_type != WireType::LengthDelimeted) return true;
+
+                typename entry_fields::state entry;
+                if (!entry_fields::walk(entry, record.data, record.data + record.size)) return false;
+
+                field.entries.push_back(record_payload(record));
+                return true;
+            }
+
+            static bool equal(const state &a, const state &b)
+            {
+                if (a.entries.empty() || b.entries.empty()) return a.entries.empty() && b.entries.empty();
+
+                auto sorted_a = sorted_entries(a);
+                auto sorted_b = sorted_entries(b);
+                if (sorted_a.size() != sorted_b.size()) return false;
+
+                for (size_t i = 0; i < sorted_a.size(); ++i)
+                {
+                    if (!key_model::equal_values(sorted_a[i].key, sorted_b[i].key)) return false;
+
+                    typename entry_fields::state entry_a, entry_b;
+                    walk_entry(sorted_a[i].entry, entry_a);
+                    walk_entry(sorted_b[i].entry, entry_b);
+                    if (!value_field::equal(std::get<1>(entry_a.fields), std::get<1>(entry_b.fields))) return false;
+                }
+                return true;
+            }
+
+            static bool hash(uint32_t tag, const state &field, uint64_t &hash)
+            {
+                if (field.entries.empty()) return true;
+
+                auto sorted = sorted_entries(field);
+
+                uint64_t entries_hash = 0;
+                for (const auto &entry : sorted)
+                {
+                    typename entry_fields::state entry_state;
+                    walk_entry(entry.entry, entry_state);
+
+                    uint64_t entry_hash = 0;
+                    if (!entry_fields::hash(entry_state, entry_hash)) return false;
+
+                    entries_hash = hash_combine(entries_hash, entry_hash);
+                }
+
+                hash = hash_combine(hash_combine(hash_combine(hash, tag), entries_hash), sorted.size());
+                return true;
+            }
+
+            static bool canonicalize(uint32_t tag, const state &field, writer &out, bool /*force*/)
+            {
+                for (const auto &entry : sorted_entries(field))
+                {
+                    typename entry_fields::state entry_state;
+                    walk_entry(entry.entry, entry_state);
+
+                    writer_size_collector size_collector;
+                    if (!write_entry(entry_state, size_collector)) return false;
+
+                    write_tag_wire_type(tag, WireType::LengthDelimeted, out);
+                    write_varint(size_collector.byte_size, out);
+                    if (!write_entry(entry_state, out)) return false;
+                }
+                return true;
+            }
+
+        private:
+            struct keyed_entry
+            {
+                typename key_model::value_type key;
+                std::string_view entry;
+            };
+
+            // One entry per key in key order, the first one of every key
+            static std::vector<keyed_entry> sorted_entries(const state &field)
+            {
+                std::vector<keyed_entry> sorted;
+                sorted.reserve(field.entries.size());
+                for (auto entry : field.entries)
+                {
+                    typename entry_fields::state entry_state;
+                    walk_entry(entry, entry_state);
+                    sorted.push_back({std::get<0>(entry_state.fields).value, entry});
+                }
+
+                std::stable_sort(sorted.begin(), sorted.end(), [](const keyed_entry & a, const keyed_entry & b)
+                {
+                    return key_model::less(a.key, b.key);
+                });
+
+                sorted.erase(std::unique(sorted.begin(), sorted.end(), [](const keyed_entry & a, const keyed_entry & b)
+                {
+                    return !key_model::less(a.key, b.key);
+                }), sorted.end());
+                return sorted;
+            }
+
+            // Entries were checked when they were added
+            static void walk_entry(std::string_view entry, typename entry_fields::state &entry_state)
+            {
+                auto begin = reinterpret_cast<const uint8_t *>(entry.data());
+                entry_fields::walk(entry_state, begin, begin + entry.size());
+            }
+
+            static bool write_entry(const typename entry_fields::state &entry, writer &out)
+            {
+                return key_field::canonicalize(1, std::get<0>(entry.fields), out, true)
+                       && value_field::canonicalize(2, std::get<1>(entry.fields), out, true);
+            }
+        };
+
+        template<uint32_t Tag, class MemPtrT, MemPtrT MemPtr, uint32_t Flags>
+        struct wire_field_traits<field_impl<Tag, MemPtrT, MemPtr, Flags>>
+        {
+            using type = wire_field<Tag, wire_field_model_t<typename field_impl<Tag, MemPtrT, MemPtr, Flags>::member_type, Flags>>;
+        };
+
+        template<uint32_t Tag, size_t Index, class MemPtrT, MemPtrT MemPtr, uint32_t Flags>
+        struct wire_field_traits<oneof_field_impl<Tag, Index, MemPtrT, MemPtr, Flags>>
+        {
+            using alternative_type = std::variant_alternative_t<Index, typename oneof_field_impl<Tag, Index, MemPtrT, MemPtr, Flags>::member_type>;
+            using value_model = wire_value_model_t<alternative_type, Flags>;
+            using model = std::conditional_t<std::is_same_v<value_model, wire_message_model<alternative_type>>,
+                  wire_oneof_message_field<alternative_type>, wire_last_field<value_model>>;
+            using type = wire_field<Tag, model, std::integral_constant<MemPtrT, MemPtr>>;
+        };
+
+        template<uint32_t Tag, class MemPtrT, MemPtrT MemPtr, uint32_t KeyFlags, uint32_t ValueFlags>
+        struct wire_field_traits<map_field_impl<Tag, MemPtrT, MemPtr, KeyFlags, ValueFlags>>
+        {
+            using map_type = typename map_field_impl<Tag, MemPtrT, MemPtr, KeyFlags, ValueFlags>::member_type;
+            using type = wire_field<Tag, wire_map_field<typename map_type::key_type, typename map_type::mapped_type, KeyFlags, ValueFlags>>;
+        };
+
+        // State of every field of a message after one pass over its records. Nested singular
+        // messages are folded into their own state as their records go by, so every byte is read
+        // once and nesting has no limit but the stack.
+        template<class... Fields>
+        struct wire_fields
+        {
+            struct state
+            {
+                std::tuple<typename Fields::model::state...> fields;
+                uint64_t records = 0;
+                mutable size_t canonical_size = SIZE_MAX;
+            };
+
+            // Adds the records of one buffer, singular messages call this once per occurrence
+            static bool walk(state &message, const uint8_t *pos, const uint8_t *end)
+            {
+                while (pos != end)
+                {
+                    wire_record record;
+                    if (!read_record(record, pos, end)) return false;
+
+                    ++message.records;
+                    if (!add(message, record, std::index_sequence_for<Fields...>())) return false;
+                }
+                return true;
+            }
+
+            static bool equal(const state &a, const state &b)
+            {
+                return equal(a, b, std::index_sequence_for<Fields...>());
+            }
+
+            static bool hash(const state &message, uint64_t &result)
+            {
+                return hash(message, result, std::index_sequence_for<Fields...>());
+            }
+
+            static bool canonicalize(const state &message, writer &out)
+            {
+                return canonicalize(message, out, std::index_sequence_for<Fields...>());
+            }
+
+            static bool canonical_size(const state &message, size_t &size)
+            {
+                if (message.canonical_size == SIZE_MAX)
+                {
+                    writer_size_collector size_collector;
+                    if (!canonicalize(message, size_collector)) return false;
+
+                    message.canonical_size = size_collector.byte_size;
+                }
+
+                size = message.canonical_size;
+                return true;
+            }
+
+        private:
+            template<size_t I>
+            using field_at = std::tuple_element_t<I, std::tuple<Fields...>>;
+
+            template<size_t... I>
+            static bool add(state &message, const wire_record &record, std::index_sequence<I...>)
+            {
+                bool result = true;
+                ((Fields::tag == record.tag && (result = add_field<I>(message, record), true)) || ...);
+                return result;
+            }
+
+            template<size_t I>
+            static bool add_field(state &message, const wire_record &record)
+            {
+                auto &field = std::get<I>(message.fields);
+                if constexpr(!std::is_void_v<typename field_at<I>::oneof_member>)
+                {
+                    // The variant switched to a sibling since the last occurrence and back now
+                    if (superseded<I>(message, std::index_sequence_for<Fields...>()))
+                    {
+                        field = typename field_at<I>::model::state();
+                    }
+                }
+                return field_at<I>::model::add(field, record, message.records);
+            }
+
+            // Field state, or the cleared one for a oneof alternative that a later alternative replaced
+            template<size_t I>
+            static const auto &resolved(const state &message)
+            {
+                using field_state = typename field_at<I>::model::state;
+
+                if constexpr(!std::is_void_v<typename field_at<I>::oneof_member>)
+                {
+                    static const field_state cleared {};
+                    if (superseded<I>(message, std::index_sequence_for<Fields...>())) return cleared;
+                }
+                return std::get<I>(message.fields);
+            }
+
+            template<size_t I, size_t... J>
+            static bool superseded(const state &message, std::index_sequence<J...>)
+            {
+                return (later_alternative<I, J>(message) || ...);
+            }
+
+            template<size_t I, size_t J>
+            static bool later_alternative(const state &message)
+            {
+                if constexpr(I != J && std::is_same_v<typename field_at<I>::oneof_member, typename field_at<J>::oneof_member>)
+                {
+                    return std::get<J>(message.fields).ordinal > std::get<I>(message.fields).ordinal;
+                }
+                else
+                {
+                    return false;
+                }
+            }
+
+            template<size_t... I>
+            static bool equal(const state &a, const state &b, std::index_sequence<I...>)
+            {
+                return (Fields::model::equal(resolved<I>(a), resolved<I>(b)) && ...);
+            }
+
+            template<size_t... I>
+            static bool hash(const state &message, uint64_t &result, std::index_sequence<I...>)
+            {
+                return (Fields::model::hash(Fields::tag, resolved<I>(message), result) && ...);
+            }
+
+            template<size_t... I>
+            static bool canonicalize(const state &message, writer &out, std::index_sequence<I...>)
+            {
+                return (Fields::model::canonicalize(Fields::tag, resolved<I>(message), out, false) && ...);
+            }
+        };
+
+    }
+
+    // Compares two serialized T the way their parsed values would compare: field order, packed or
+    // unpacked repeated fields and explicitly encoded default values make no difference, unknown
+    // fields are ignored. Every buffer is read once; the records of repeated and map fields are kept
+    // and compared element by element, map entries in key order with the first entry of a key
+    // winning like in parsing. Malformed buffers never compare equal.
+    template<class T>
+    bool wire_equal(std::string_view a, std::string_view b)
+    {
+        return detail::wire_message_model<T>::equal_values(a, b);
+    }
+
+    // Hash consistent with wire_equal
+    template<class T>
+    bool wire_hash(uint64_t &hash, std::string_view in)
+    {
+        return detail::wire_message_model<T>::hash_value(in, hash);
+    }
+
+    // Rewrites a serialized T into exactly what serialize_to_string would produce for its parsed value,
+    // except that negative zeros are written as positive ones. One pass over in collects the records
+    // of repeated and map fields, which are then written in descriptor and key order.
+    template<class T>
+    bool canonicalize(std::string_view in, writer &out)
+    {
+        typename detail::wire_message_fields<T>::state state;
+        return detail::wire_message_model<T>::walk(in, state) && detail::wire_message_fields<T>::canonicalize(state, out);
+    }
+
+    template<class T>
+    bool canonicalize_to_string(std::string_view in, std::string &out)
+    {
+        string_writer string_out(out);
+        return canonicalize<T>(in, string_out);
+    }
+}
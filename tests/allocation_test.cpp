@@ -0,0 +1,324 @@
+// Runs serialize/parse calls on descriptor fixtures and compares their allocation counts with
+// allocation_baselines.txt. A case fails when it allocates more than its baseline.
+
+#define PROTOPUG_ALLOCATION_COUNTER_IMPLEMENTATION
+#include "protopug/allocation_counter.h"
+#include "protopug/batch.h"
+#include "protopug/message_pool.h"
+#include "protopug/parse_table.h"
+#include "protopug/protopug.h"
+#include "protopug/validate.h"
+#include "protopug/wire_compare.h"
+
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <sstream>
+
+enum class Status : int32_t
+{
+    unknown = 0,
+    active = 1,
+    suspended = 2
+};
+
+struct Address
+{
+    std::string city;
+    std::string street;
+    int32_t zip = 0;
+};
+
+struct Account
+{
+    int64_t id = 0;
+    std::string name;
+    Status status = Status::unknown;
+    double balance = 0;
+    bool verified = false;
+    std::vector<int32_t> scores;
+    std::vector<double> history;
+    std::vector<bool> flags;
+    std::vector<Status> states;
+    Address address;
+    std::variant<std::string, int64_t> contact;
+};
+
+struct Directory
+{
+    std::vector<Account> accounts;
+    std::vector<std::string> tags;
+    std::map<int32_t, std::string> names;
+};
+
+namespace protopug
+{
+    template<>
+    struct descriptor<Address>
+    {
+        static auto type()
+        {
+            return message(
+                        field<1, &Address::city, flags::utf8>("city"),
+                        field<2, &Address::street, flags::utf8>("street"),
+                        field<3, &Address::zip>("zip")
+                   );
+        }
+    };
+
+    template<>
+    struct descriptor<Account>
+    {
+        static auto type()
+        {
+            return message(
+                        field<1, &Account::id>("id"),
+                        field<2, &Account::name, flags::utf8>("name"),
+                        field<3, &Account::status>("status"),
+                        field<4, &Account::balance>("balance"),
+                        field<5, &Account::verified>("verified"),
+                        field<6, &Account::scores>("scores"),
+                        field<7, &Account::history>("history"),
+                        field<8, &Account::address>("address"),
+                        oneof_group("contact",
+                                    oneof_field<9, 0, &Account::contact, flags::utf8>("email"),
+                                    oneof_field<10, 1, &Account::contact>("phone")),
+                        field<11, &Account::flags>("flags"),
+                        field<12, &Account::states>("states")
+                   );
+        }
+    };
+
+    template<>
+    struct descriptor<Directory>
+    {
+        static auto type()
+        {
+            return message(
+                        field<1, &Directory::accounts>("accounts"),
+                        field<2, &Directory::tags>("tags"),
+                        map_field<3, &Directory::names, flags::no, flags::utf8>("names")
+                   );
+        }
+    };
+}
+
+namespace
+{
+    Account make_account(int32_t seed)
+    {
+        Account account;
+        account.id = 1000000007LL * seed;
+        account.name = "account holder number " + std::to_string(seed);
+        account.status = seed % 2 ? Status::active : Status::suspended;
+        account.balance = seed * 12.5;
+        account.verified = seed % 3 == 0;
+        for (int32_t i = 0; i < 40; ++i)
+        {
+            account.scores.push_back(i * seed % 300 - 20);
+            account.history.push_back(i * 0.25);
+            account.flags.push_back(i % 3 == 0);
+            account.states.push_back(static_cast<Status>(i % 3));
+        }
+        account.address.city = "a city with a long name";
+        account.address.street = "a street with a long name " + std::to_string(seed);
+        account.address.zip = 10000 + seed;
+        account.contact = "holder" + std::to_string(seed) + "@mail.example.com";
+        return account;
+    }
+
+    Directory make_directory()
+    {
+        Directory directory;
+        for (int32_t i = 1; i <= 8; ++i)
+        {
+            directory.accounts.push_back(make_account(i));
+            directory.tags.push_back("a tag that does not fit inline " + std::to_string(i));
+            directory.names[i] = "a name that does not fit inline " + std::to_string(i);
+        }
+        return directory;
+    }
+
+    struct allocation_case
+    {
+        std::string name;
+        std::function<bool()> run;
+    };
+
+    std::map<std::string, size_t> read_baselines(const char *path)
+    {
+        std::map<std::string, size_t> baselines;
+
+        std::ifstream in(path);
+        std::string line;
+        while (std::getline(in, line))
+        {
+            if (line.empty() || line[0] == '#') continue;
+
+            std::istringstream fields(line);
+            std::string name;
+            size_t count;
+            if (fields >> name >> count) baselines[name] = count;
+        }
+
+        return baselines;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        std::fprintf(stderr, "usage: %s allocation_baselines.txt\n", argv[0]);
+        return 2;
+    }
+
+    auto baselines = read_baselines(argv[1]);
+    if (baselines.empty())
+    {
+        std::fprintf(stderr, "no baselines in %s\n", argv[1]);
+        return 2;
+    }
+
+    if (!protopug::allocation_counter_installed())
+    {
+        std::fprintf(stderr, "allocation counter is not installed\n");
+        return 1;
+    }
+
+    const Account account = make_account(7);
+    const Directory directory = make_directory();
+    const std::string encoded_account = protopug::serialize_as_string(account);
+    const std::string encoded_directory = protopug::serialize_as_string(directory);
+    const std::vector<Account> batch_accounts(directory.accounts);
+
+    std::string buffer(64 * 1024, '\0');
+    std::string out;
+    out.reserve(64 * 1024);
+    Account reused_account = account;
+    Directory reused_directory = directory;
+    std::string batch;
+    protopug::serialize_many(batch_accounts, batch);
+    std::vector<Account> parsed_batch;
+
+    std::vector<allocation_case> cases =
+    {
+        {"malloc", [&]
+        {
+            // Only a sanity check of the counter, a malloc has to be seen
+            void *data = std::malloc(32);
+            bool seen = data != nullptr;
+            std::free(data);
+            return seen;
+        }},
+        {"serialize_into/account", [&]
+        {
+            return protopug::serialize_into(account, buffer.data(), buffer.size()) == encoded_account.size();
+        }},
+        {"serialize_into/directory", [&]
+        {
+            return protopug::serialize_into(directory, buffer.data(), buffer.size()) == encoded_directory.size();
+        }},
+        {"serialize_to_string/directory_reserved", [&]
+        {
+            out.clear();
+            protopug::serialize_to_string(directory, out);
+            return out == encoded_directory;
+        }},
+        {"serialize_as_string/directory", [&]
+        {
+            return protopug::serialize_as_string(directory) == encoded_directory;
+        }},
+        {"parse/account", [&]
+        {
+            Account parsed;
+            return protopug::parse_from_string(parsed, encoded_account);
+        }},
+        {"parse/account_reused", [&]
+        {
+            protopug::reset_message(reused_account);
+            return protopug::parse_from_string(reused_account, encoded_account);
+        }},
+        {"parse/directory", [&]
+        {
+            Directory parsed;
+            return protopug::parse_from_string(parsed, encoded_directory);
+        }},
+        {"parse/directory_reused", [&]
+        {
+            protopug::reset_message(reused_directory);
+            return protopug::parse_from_string(reused_directory, encoded_directory);
+        }},
+        {"table_parse/account_reused", [&]
+        {
+            protopug::reset_message(reused_account);
+            return protopug::table_parse_from_string(reused_account, encoded_account);
+        }},
+        {"validate/directory", [&]
+        {
+            return protopug::validate<Directory>(encoded_directory);
+        }},
+        {"wire_equal/directory", [&]
+        {
+            return protopug::wire_equal<Directory>(encoded_directory, encoded_directory);
+        }},
+        {"wire_hash/directory", [&]
+        {
+            uint64_t hash;
+            return protopug::wire_hash<Directory>(hash, encoded_directory);
+        }},
+        {"serialize_many/accounts_reserved", [&]
+        {
+            out.clear();
+            return protopug::serialize_many(batch_accounts, out) && out == batch;
+        }},
+        {"parse_many/accounts_reused", [&]
+        {
+            parsed_batch.clear();
+            return protopug::parse_many(parsed_batch, batch);
+        }},
+    };
+
+    int failures = 0;
+    for (auto &test : cases)
+    {
+        // The first run fills function statics and container capacities
+        if (!test.run())
+        {
+            std::printf("FAIL %s: call failed\n", test.name.c_str());
+            ++failures;
+            continue;
+        }
+
+        bool ok = true;
+        size_t count = protopug::count_allocations([&] { ok = test.run(); });
+
+        auto baseline = baselines.find(test.name);
+        if (!ok)
+        {
+            std::printf("FAIL %s: call failed\n", test.name.c_str());
+            ++failures;
+        }
+        else if (baseline == baselines.end())
+        {
+            std::printf("FAIL %s: %zu allocations, no baseline\n", test.name.c_str(), count);
+            ++failures;
+        }
+        else if (test.name == "malloc" ? count == 0 : count > baseline->second)
+        {
+            std::printf("FAIL %s: %zu allocations, baseline %zu\n", test.name.c_str(), count, baseline->second);
+            ++failures;
+        }
+        else if (count < baseline->second)
+        {
+            std::printf("ok   %s: %zu allocations, baseline %zu can be lowered\n", test.name.c_str(), count, baseline->second);
+        }
+        else
+        {
+            std::printf("ok   %s: %zu allocations\n", test.name.c_str(), count);
+        }
+    }
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,199 @@
+// Round-trips messages through the compression adapters of the codecs the build found
+
+#include "protopug/compression.h"
+#include "protopug/protopug.h"
+
+#include <cstdio>
+#include <functional>
+#include <stdexcept>
+
+struct Entry
+{
+    int64_t id = 0;
+    std::string text;
+    std::vector<int32_t> values;
+};
+
+struct Log
+{
+    std::vector<Entry> entries;
+};
+
+namespace protopug
+{
+    template<>
+    struct descriptor<Entry>
+    {
+        static auto type()
+        {
+            return message(
+                        field<1, &Entry::id>("id"),
+                        field<2, &Entry::text>("text"),
+                        field<3, &Entry::values>("values")
+                   );
+        }
+    };
+
+    template<>
+    struct descriptor<Log>
+    {
+        static auto type()
+        {
+            return message(
+                        field<1, &Log::entries>("entries")
+                   );
+        }
+    };
+}
+
+namespace
+{
+    Log make_log()
+    {
+        Log log;
+        for (int32_t i = 0; i < 2000; ++i)
+        {
+            Entry entry;
+            entry.id = i;
+            entry.text = "entry number " + std::to_string(i);
+            entry.values = {i, i * 2, i * 3};
+            log.entries.push_back(entry);
+        }
+        return log;
+    }
+
+    bool same(const Log &a, const Log &b)
+    {
+        if (a.entries.size() != b.entries.size()) return false;
+
+        for (size_t i = 0; i < a.entries.size(); ++i)
+        {
+            const Entry &x = a.entries[i];
+            const Entry &y = b.entries[i];
+            if (x.id != y.id || x.text != y.text || x.values != y.values) return false;
+        }
+        return true;
+    }
+
+    // Buffers small enough that the codec runs out of input and output many times
+    template<class Writer, class Reader>
+    bool round_trip(int level)
+    {
+        const Log log = make_log();
+
+        std::string compressed;
+        protopug::string_writer string_out(compressed);
+        Writer compressed_out(string_out, level, 512);
+        protopug::serialize_to_writer(log, compressed_out);
+        if (!compressed_out.finish() || compressed.size() >= protopug::serialize_as_string(log).size()) return false;
+
+        Log parsed;
+        protopug::buffer_reader buffer_in(compressed.data(), compressed.size());
+        Reader compressed_in(buffer_in, 512);
+        return protopug::parse_from_reader(parsed, compressed_in) && compressed_in.finished() && !compressed_in.failed()
+               && same(parsed, log);
+    }
+
+    template<class Reader>
+    bool truncated_fails(const std::string &compressed)
+    {
+        Log parsed;
+        protopug::buffer_reader buffer_in(compressed.data(), compressed.size() / 2);
+        Reader compressed_in(buffer_in);
+        protopug::parse_from_reader(parsed, compressed_in);
+        return compressed_in.failed();
+    }
+
+    struct throwing_writer : public protopug::writer
+    {
+        void write(const void *, size_t) override
+        {
+            throw std::runtime_error("write failed");
+        }
+    };
+
+    // The stream is ended in the destructor, which must not pass on what the writer throws
+    template<class Writer>
+    bool destructor_swallows_throw()
+    {
+        try
+        {
+            throwing_writer out;
+            Writer compressed_out(out);
+            protopug::serialize_to_writer(make_log().entries[0], compressed_out);
+        }
+        catch (...)
+        {
+            return false;
+        }
+        return true;
+    }
+
+    template<class Writer>
+    std::string compress(const Log &log)
+    {
+        std::string compressed;
+        protopug::string_writer string_out(compressed);
+        Writer compressed_out(string_out);
+        protopug::serialize_to_writer(log, compressed_out);
+        compressed_out.finish();
+        return compressed;
+    }
+
+    struct compression_case
+    {
+        std::string name;
+        std::function<bool()> run;
+    };
+}
+
+int main()
+{
+    std::vector<compression_case> cases =
+    {
+#if defined(PROTOPUG_WITH_ZLIB)
+        {"zlib/round_trip", []
+        {
+            return round_trip<protopug::zlib_writer, protopug::zlib_reader>(Z_DEFAULT_COMPRESSION);
+        }},
+        {"zlib/truncated", []
+        {
+            return truncated_fails<protopug::zlib_reader>(compress<protopug::zlib_writer>(make_log()));
+        }},
+        {"zlib/destructor_swallows_throw", []
+        {
+            return destructor_swallows_throw<protopug::zlib_writer>();
+        }},
+#endif
+#if defined(PROTOPUG_WITH_ZSTD)
+        {"zstd/round_trip", []
+        {
+            return round_trip<protopug::zstd_writer, protopug::zstd_reader>(ZSTD_CLEVEL_DEFAULT);
+        }},
+        {"zstd/truncated", []
+        {
+            return truncated_fails<protopug::zstd_reader>(compress<protopug::zstd_writer>(make_log()));
+        }},
+        {"zstd/destructor_swallows_throw", []
+        {
+            return destructor_swallows_throw<protopug::zstd_writer>();
+        }},
+#endif
+    };
+
+    int failures = 0;
+    for (auto &test : cases)
+    {
+        if (test.run())
+        {
+            std::printf("ok   %s\n", test.name.c_str());
+        }
+        else
+        {
+            std::printf("FAIL %s\n", test.name.c_str());
+            ++failures;
+        }
+    }
+
+    return failures ? 1 : 0;
+}
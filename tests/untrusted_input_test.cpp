@@ -0,0 +1,237 @@
+// Feeds forged length prefixes through a reader that doesn't know the size of its input, like a
+// pipe or a decompressing reader. Parsing must not allocate what the prefix claims.
+
+#include "protopug/parse_table.h"
+#include "protopug/protopug.h"
+#include "protopug/record_log.h"
+
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <new>
+
+struct Samples
+{
+    std::vector<double> values;
+    std::vector<bool> flags;
+};
+
+struct Text
+{
+    std::string body;
+    std::string title;
+};
+
+namespace protopug
+{
+    template<>
+    struct descriptor<Samples>
+    {
+        static auto type()
+        {
+            return message(
+                        field<1, &Samples::values>("values"),
+                        field<2, &Samples::flags>("flags")
+                   );
+        }
+    };
+
+    template<>
+    struct descriptor<Text>
+    {
+        static auto type()
+        {
+            return message(
+                        field<1, &Text::body>("body"),
+                        field<2, &Text::title, flags::utf8>("title")
+                   );
+        }
+    };
+}
+
+namespace
+{
+    // No available_bytes() and no peek()
+    class stream_reader : public protopug::reader
+    {
+    public:
+        explicit stream_reader(const std::string &data)
+            : _data(data)
+        {
+        }
+
+        size_t read(void *bytes, size_t size) override
+        {
+            size = std::min(size, _data.size() - _pos);
+            std::memcpy(bytes, _data.data() + _pos, size);
+            _pos += size;
+            return size;
+        }
+
+    private:
+        const std::string &_data;
+        size_t _pos = 0;
+    };
+
+    // Field tag with a length prefix of 2^40 and a few bytes of payload
+    std::string forged(uint8_t tag_key)
+    {
+        return std::string(1, static_cast<char>(tag_key)) + std::string("\x80\x80\x80\x80\x80\x20", 6) + std::string(8, '\x01');
+    }
+
+    // The main parser skips a field it can't read, the table parser fails; neither may allocate
+    // for the claimed length
+    bool small(const Samples &samples)
+    {
+        return samples.values.capacity() < 1024 && samples.flags.capacity() < 1024 * 64;
+    }
+
+    bool small(const Text &text)
+    {
+        return text.body.capacity() < 1024 * 1024 && text.title.capacity() < 1024 * 1024;
+    }
+
+    template<class T>
+    bool contained(const std::string &in)
+    {
+        try
+        {
+            for (int limited = 0; limited < 2; ++limited)
+            {
+                T parsed, table_parsed;
+                stream_reader parse_in(in), table_in(in);
+                bool table_ok = limited ? protopug::table_parse_from_reader(table_parsed, table_in, protopug::parse_limits {})
+                                : protopug::table_parse_from_reader(table_parsed, table_in);
+                if (limited)
+                {
+                    protopug::parse_from_reader(parsed, parse_in, protopug::parse_limits {});
+                }
+                else
+                {
+                    protopug::parse_from_reader(parsed, parse_in);
+                }
+
+                if (table_ok || !small(parsed) || !small(table_parsed)) return false;
+            }
+            return true;
+        }
+        catch (const std::bad_alloc &)
+        {
+            return false;
+        }
+    }
+
+    // Frame header claiming size bytes of payload, with a correct header checksum
+    std::string forged_frame(uint32_t size)
+    {
+        uint8_t header[protopug::detail::record_frame_header_size] = {};
+        protopug::detail::store_le32(header, protopug::detail::record_frame_magic);
+        protopug::detail::store_le32(header + 4, size);
+        protopug::detail::store_le32(header + 8, protopug::detail::masked_crc32c(header, 8));
+        return std::string(reinterpret_cast<const char *>(header), sizeof(header));
+    }
+
+    // The forged frame is dropped and the intact one behind it read
+    bool skips_forged_frame(protopug::reader &in, size_t max_record_size)
+    {
+        try
+        {
+            protopug::record_log_reader log(in, 4096, max_record_size);
+            const uint8_t *data;
+            size_t size;
+            return log.next_raw(data, size) && std::string(reinterpret_cast<const char *>(data), size) == "intact"
+                   && !log.next_raw(data, size) && log.corrupt_frames() == 1;
+        }
+        catch (const std::bad_alloc &)
+        {
+            return false;
+        }
+    }
+
+    std::string log_with_forged_frame(uint32_t size)
+    {
+        std::string log = forged_frame(size);
+        protopug::string_writer out(log);
+        protopug::record_log_writer(out).append_raw("intact", 6);
+        return log;
+    }
+
+    struct input_case
+    {
+        std::string name;
+        std::function<bool()> run;
+    };
+}
+
+int main()
+{
+    std::vector<input_case> cases =
+    {
+        {"stream/valid", []
+        {
+            Samples samples;
+            samples.values = {1.5, -2.25};
+            samples.flags = {true, false, true};
+            std::string encoded = protopug::serialize_as_string(samples);
+
+            Samples parsed;
+            stream_reader in(encoded);
+            return protopug::parse_from_reader(parsed, in) && parsed.values == samples.values && parsed.flags == samples.flags;
+        }},
+        {"packed_fixed/forged_length", []
+        {
+            return contained<Samples>(forged(0x0a));
+        }},
+        {"packed_small_varint/forged_length", []
+        {
+            return contained<Samples>(forged(0x12));
+        }},
+        {"string/forged_length", []
+        {
+            return contained<Text>(forged(0x0a));
+        }},
+        {"utf8_string/forged_length", []
+        {
+            return contained<Text>(forged(0x12));
+        }},
+        {"record_log/size_beyond_input", []
+        {
+            std::string log = log_with_forged_frame(1024 * 1024);
+            protopug::buffer_reader in(log.data(), log.size());
+            return skips_forged_frame(in, SIZE_MAX);
+        }},
+        {"record_log/size_above_maximum", []
+        {
+            std::string log = log_with_forged_frame(0xFFFFFFF0);
+            stream_reader in(log);
+            return skips_forged_frame(in, 1024 * 1024);
+        }},
+        {"record_log/record_too_large_to_write", []
+        {
+            // The size check comes before the data is touched
+            std::string log;
+            protopug::string_writer out(log);
+            protopug::record_log_writer writer(out);
+            char byte = 0;
+            bool appended = writer.append_raw(&byte, size_t(1) << 32);
+            writer.flush();
+            return !appended && log.empty();
+        }},
+    };
+
+    int failures = 0;
+    for (auto &test : cases)
+    {
+        if (test.run())
+        {
+            std::printf("ok   %s\n", test.name.c_str());
+        }
+        else
+        {
+            std::printf("FAIL %s\n", test.name.c_str());
+            ++failures;
+        }
+    }
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,221 @@
+// Checks wire_equal, wire_hash and canonicalize against the values the parser produces
+
+#include "protopug/protopug.h"
+#include "protopug/wire_compare.h"
+
+#include <cstdio>
+#include <functional>
+
+struct Numbers
+{
+    std::vector<uint64_t> values;
+    std::vector<std::string> names;
+    std::map<int32_t, int32_t> counts;
+};
+
+struct Point
+{
+    int32_t x = 0;
+    int32_t y = 0;
+};
+
+struct Shape
+{
+    std::variant<Point, std::string> kind;
+};
+
+struct GroupedShape
+{
+    std::variant<Point, std::string> kind;
+};
+
+namespace protopug
+{
+    template<>
+    struct descriptor<Point>
+    {
+        static auto type()
+        {
+            return message(
+                        field<1, &Point::x>("x"),
+                        field<2, &Point::y>("y")
+                   );
+        }
+    };
+
+    template<>
+    struct descriptor<Shape>
+    {
+        static auto type()
+        {
+            return message(
+                        oneof_field<1, 0, &Shape::kind>("point"),
+                        oneof_field<2, 1, &Shape::kind>("name")
+                   );
+        }
+    };
+
+    template<>
+    struct descriptor<GroupedShape>
+    {
+        static auto type()
+        {
+            return message(
+                        oneof_group("kind",
+                                    oneof_field<1, 0, &GroupedShape::kind>("point"),
+                                    oneof_field<2, 1, &GroupedShape::kind>("name"))
+                   );
+        }
+    };
+
+    template<>
+    struct descriptor<Numbers>
+    {
+        static auto type()
+        {
+            return message(
+                        field<1, &Numbers::values>("values"),
+                        field<2, &Numbers::names>("names"),
+                        map_field<3, &Numbers::counts>("counts")
+                   );
+        }
+    };
+}
+
+namespace
+{
+    std::string bytes(const char *data, size_t size)
+    {
+        return std::string(data, size);
+    }
+
+    template<class T>
+    bool same_hash(const std::string &a, const std::string &b)
+    {
+        uint64_t hash_a, hash_b;
+        return protopug::wire_hash<T>(hash_a, a) && protopug::wire_hash<T>(hash_b, b) && hash_a == hash_b;
+    }
+
+    // in has to compare equal to, hash like and canonicalize into the encoding of its parsed value
+    template<class T>
+    bool matches_parsed(const std::string &in)
+    {
+        T parsed;
+        if (!protopug::parse_from_string(parsed, in)) return false;
+
+        std::string encoded = protopug::serialize_as_string(parsed);
+        std::string canonical;
+        return protopug::wire_equal<T>(in, encoded) && same_hash<T>(in, encoded)
+               && protopug::canonicalize_to_string<T>(in, canonical) && canonical == encoded;
+    }
+
+    struct wire_case
+    {
+        std::string name;
+        std::function<bool()> run;
+    };
+}
+
+int main()
+{
+    std::vector<wire_case> cases =
+    {
+        {"repeated/hash_collision", []
+        {
+            // Both sequences fold to the same count and running hash
+            Numbers a, b;
+            a.values = {1, 2};
+            b.values = {3, 13478614691747031080ull};
+            return !protopug::wire_equal<Numbers>(protopug::serialize_as_string(a), protopug::serialize_as_string(b));
+        }},
+        {"repeated/order", []
+        {
+            Numbers a, b;
+            a.values = {1, 2};
+            b.values = {2, 1};
+            return !protopug::wire_equal<Numbers>(protopug::serialize_as_string(a), protopug::serialize_as_string(b));
+        }},
+        {"repeated/packed_and_unpacked", []
+        {
+            Numbers a;
+            a.values = {1, 2, 3};
+            std::string mixed = bytes("\x08\x01\x0a\x02\x02\x03", 6);
+            return protopug::wire_equal<Numbers>(mixed, protopug::serialize_as_string(a))
+                   && same_hash<Numbers>(mixed, protopug::serialize_as_string(a));
+        }},
+        {"repeated/string_boundaries", []
+        {
+            Numbers a, b;
+            a.names = {"ab", "c"};
+            b.names = {"a", "bc"};
+            return !protopug::wire_equal<Numbers>(protopug::serialize_as_string(a), protopug::serialize_as_string(b));
+        }},
+        {"map/swapped_values", []
+        {
+            Numbers a, b;
+            a.counts = {{1, 10}, {2, 20}};
+            b.counts = {{1, 20}, {2, 10}};
+            return !protopug::wire_equal<Numbers>(protopug::serialize_as_string(a), protopug::serialize_as_string(b));
+        }},
+        {"map/entry_order", []
+        {
+            Numbers a;
+            a.counts = {{1, 10}, {2, 20}};
+            std::string reversed = bytes("\x1a\x04\x08\x02\x10\x14\x1a\x04\x08\x01\x10\x0a", 12);
+            return protopug::wire_equal<Numbers>(reversed, protopug::serialize_as_string(a))
+                   && same_hash<Numbers>(reversed, protopug::serialize_as_string(a));
+        }},
+        {"map/first_entry_of_key_wins", []
+        {
+            Numbers a;
+            a.counts = {{1, 10}, {2, 20}};
+            std::string encoded = protopug::serialize_as_string(a);
+            std::string duplicate = encoded + bytes("\x1a\x04\x08\x01\x10\x63", 6);
+
+            Numbers parsed;
+            std::string canonical;
+            return protopug::parse_from_string(parsed, duplicate) && parsed.counts == a.counts
+                   && protopug::wire_equal<Numbers>(duplicate, encoded) && same_hash<Numbers>(duplicate, encoded)
+                   && protopug::canonicalize_to_string<Numbers>(duplicate, canonical) && canonical == encoded;
+        }},
+        {"oneof/message_occurrences_merge", []
+        {
+            // point {x: 5} point {y: 7} parses to point {x: 5, y: 7}
+            std::string in = bytes("\x0a\x02\x08\x05\x0a\x02\x10\x07", 8);
+
+            Shape parsed;
+            return matches_parsed<Shape>(in) && matches_parsed<GroupedShape>(in)
+                   && protopug::parse_from_string(parsed, in) && std::get<0>(parsed.kind).x == 5 && std::get<0>(parsed.kind).y == 7;
+        }},
+        {"oneof/sibling_in_between_resets", []
+        {
+            // point {x: 5} name "n" point {y: 7} parses to point {y: 7}
+            std::string in = bytes("\x0a\x02\x08\x05\x12\x01n\x0a\x02\x10\x07", 11);
+
+            Shape parsed;
+            return matches_parsed<Shape>(in) && matches_parsed<GroupedShape>(in)
+                   && protopug::parse_from_string(parsed, in) && std::get<0>(parsed.kind).x == 0 && std::get<0>(parsed.kind).y == 7;
+        }},
+        {"oneof/last_alternative_wins", []
+        {
+            std::string in = bytes("\x0a\x02\x08\x05\x12\x01n", 7);
+            return matches_parsed<Shape>(in) && matches_parsed<GroupedShape>(in);
+        }},
+    };
+
+    int failures = 0;
+    for (auto &test : cases)
+    {
+        if (test.run())
+        {
+            std::printf("ok   %s\n", test.name.c_str());
+        }
+        else
+        {
+            std::printf("FAIL %s\n", test.name.c_str());
+            ++failures;
+        }
+    }
+
+    return failures ? 1 : 0;
+}